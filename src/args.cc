@@ -1,14 +1,23 @@
 #include "supershader.h"
 
 #include "argparse.h"
+#include "nlohmann/json.hpp"
 #include <sstream>
+#include <fstream>
+#include <algorithm>
 
 #ifndef SUPERSHADER_VERSION
 #define SUPERSHADER_VERSION ""
 #endif
 
+#ifndef ENABLE_OPT
+#define ENABLE_OPT 0
+#endif
+
 using namespace supershader;
 
+using json = nlohmann::json;
+
 const char kPathSeparator =
 #ifdef _WIN32
 '\\';
@@ -21,6 +30,9 @@ static std::string trim(const std::string &s) {
     while (start != s.end() && std::isspace(*start)) {
         start++;
     }
+
+    if (start == s.end())
+        return "";
  
     auto end = s.end();
     do {
@@ -30,6 +42,36 @@ static std::string trim(const std::string &s) {
     return std::string(start, end + 1);
 }
 
+// Bytes with optional K, M or G suffix
+static bool parse_size(int64_t& size, const char* str){
+    char* end;
+    long long value = strtoll(str, &end, 10);
+    if (end == str || value < 0)
+        return false;
+
+    std::string suffix = trim(end);
+    int64_t unit = 1;
+    if (suffix == "K" || suffix == "k"){
+        unit = 1024;
+    }else if (suffix == "M" || suffix == "m"){
+        unit = 1024 * 1024;
+    }else if (suffix == "G" || suffix == "g"){
+        unit = 1024 * 1024 * 1024;
+    }else if (!suffix.empty()){
+        return false;
+    }
+
+    size = (int64_t)value * unit;
+    return true;
+}
+
+// Each -I adds one more directory
+static int append_include_dir(struct argparse *, const struct argparse_option *option){
+    std::vector<std::string>* include_dirs = (std::vector<std::string>*)option->data;
+    include_dirs->push_back(*(const char**)option->value);
+    return 0;
+}
+
 static std::vector<define_t> parse_defines(const char *defines){
     std::stringstream ss(defines);
     std::vector<define_t> result;
@@ -55,6 +97,45 @@ static std::vector<define_t> parse_defines(const char *defines){
     return result;
 }
 
+// Every specialization constant needs a value
+static bool parse_spec_constants(std::vector<define_t>& spec_constants, const std::string& spec){
+    spec_constants.clear();
+    for (const define_t& sc : parse_defines(spec.c_str())){
+        if (sc.def.empty() && sc.value.empty())
+            continue;
+        if (sc.def.empty() || sc.value.empty())
+            return false;
+        spec_constants.push_back(sc);
+    }
+    return true;
+}
+
+static std::vector<std::string> parse_list(const std::string& list, char separator){
+    std::stringstream ss(list);
+    std::vector<std::string> result;
+
+    while( ss.good() ){
+        std::string substr;
+        getline( ss, substr, separator );
+
+        substr = trim(substr);
+        if (!substr.empty())
+            result.push_back(substr);
+    }
+
+    return result;
+}
+
+static std::vector<std::vector<std::string>> parse_variant_excludes(const std::string& excludes){
+    std::vector<std::vector<std::string>> result;
+
+    for (const std::string& rule : parse_list(excludes, ';')){
+        result.push_back(parse_list(rule, ','));
+    }
+
+    return result;
+}
+
 static std::string get_directory(const char* path) {
     std::string dir = path;
     size_t last = dir.find_last_of("/\\");
@@ -79,8 +160,203 @@ static std::string get_filename(const char* path){
     return filename;
 }
 
+static bool parse_lang(target_t& target, const std::string& lang){
+    target.name = lang;
+    target.version = 0;
+    target.es = false;
+    target.platform = PLATFORM_DEFAULT;
+
+    if (lang == "glsl330"){
+        target.lang = LANG_GLSL;
+        target.version = 330;
+    }else if (lang == "glsl410"){
+        target.lang = LANG_GLSL;
+        target.version = 410;
+    }else if (lang == "glsl430"){
+        target.lang = LANG_GLSL;
+        target.version = 430;
+    }else if (lang == "glsl100"){
+        target.lang = LANG_GLSL;
+        target.version = 100;
+        target.es = true;
+    }else if (lang == "glsl300es"){
+        target.lang = LANG_GLSL;
+        target.version = 300;
+        target.es = true;
+    }else if (lang == "hlsl4"){
+        target.lang = LANG_HLSL;
+        target.version = 40;
+    }else if (lang == "hlsl5"){
+        target.lang = LANG_HLSL;
+        target.version = 50;
+    }else if (lang == "msl12macos"){
+        target.lang = LANG_MSL;
+        target.version = 10200;
+        target.platform = PLATFORM_MACOS;
+    }else if (lang == "msl21macos"){
+        target.lang = LANG_MSL;
+        target.version = 20100;
+        target.platform = PLATFORM_MACOS;
+    }else if (lang == "msl12ios"){
+        target.lang = LANG_MSL;
+        target.version = 10200;
+        target.platform = PLATFORM_IOS;
+    }else if (lang == "msl21ios"){
+        target.lang = LANG_MSL;
+        target.version = 20100;
+        target.platform = PLATFORM_IOS;
+    }else{
+        return false;
+    }
+
+    return true;
+}
+
+static bool parse_opt_level(opt_level_t& level, const std::string& value){
+    // Accepted with or without 'O', as in -Operf or --optimization=Operf
+    std::string name = (!value.empty() && value[0] == 'O') ? value.substr(1) : value;
+
+    if (name == "0"){
+        level = OPT_LEVEL_NONE;
+    }else if (name == "1"){
+        level = OPT_LEVEL_DEFAULT;
+    }else if (name == "s"){
+        level = OPT_LEVEL_SIZE;
+    }else if (name == "perf"){
+        level = OPT_LEVEL_PERF;
+    }else{
+        return false;
+    }
+
+    return true;
+}
+
+static std::string get_lang_name(lang_type_t lang){
+    if (lang == LANG_GLSL){
+        return "glsl";
+    } else if (lang == LANG_HLSL){
+        return "hlsl";
+    } else if (lang == LANG_MSL){
+        return "msl";
+    }
+
+    return "";
+}
+
+std::vector<target_t> supershader::get_targets(const args_t& args){
+    if (!args.targets.empty())
+        return args.targets;
+
+    // Library users can fill only lang/version/es/platform
+    target_t target;
+    target.name = "";
+    target.lang = args.lang;
+    target.version = args.version;
+    target.es = args.es;
+    target.platform = args.platform;
+
+    return {target};
+}
+
+void supershader::apply_target(args_t& args, const target_t& target){
+    args.lang = target.lang;
+    args.version = target.version;
+    args.es = target.es;
+    args.platform = target.platform;
+}
+
+// Merged returns and inlining break WebGL1 and HLSL shaders
+bool supershader::needs_conservative_passes(const target_t& target){
+    return (target.lang == LANG_GLSL && target.version == 100) || target.lang == LANG_HLSL;
+}
+
+void supershader::apply_pass_recipe(args_t& args, const target_t& target){
+    args.passes.clear();
+
+    // Explicit level is not overridden by recipe
+    if (!args.opt_level_explicit && args.opt_level != OPT_LEVEL_NONE){
+        for (const std::string& key : {target.name, get_lang_name(target.lang), std::string("default")}){
+            auto it = args.pass_recipes.find(key);
+            if (!key.empty() && it != args.pass_recipes.end()){
+                args.opt_level = it->second.level;
+                args.passes = it->second.passes;
+                break;
+            }
+        }
+    }
+
+    // Custom passes are kept as they are
+    if (needs_conservative_passes(target) && args.passes.empty() && (args.opt_level == OPT_LEVEL_SIZE || args.opt_level == OPT_LEVEL_PERF))
+        args.opt_level = OPT_LEVEL_DEFAULT;
+}
+
+bool supershader::load_pass_recipes(std::map<std::string, pass_recipe_t>& recipes, const std::string& path){
+    std::ifstream ifs(path);
+    if (!ifs.is_open()){
+        print_error("Unable to open file: %s\n", path.c_str());
+        return false;
+    }
+
+    json j = json::parse(ifs, nullptr, false);
+    if (j.is_discarded() || !j.is_object()){
+        print_error("Invalid json in pass recipe: %s\n", path.c_str());
+        return false;
+    }
+
+    // Each target is "O1" or an array of spirv-opt passes
+    recipes.clear();
+    for (auto& [key, value] : j.items()){
+        pass_recipe_t recipe;
+        recipe.level = OPT_LEVEL_DEFAULT;
+        if (value.is_string()){
+            if (!parse_opt_level(recipe.level, value.get<std::string>())){
+                print_error("Pass recipe '%s': unsupported optimization level: %s\n", key.c_str(), value.get<std::string>().c_str());
+                return false;
+            }
+        }else if (value.is_array()){
+            for (const json& pass : value){
+                if (!pass.is_string()){
+                    print_error("Pass recipe '%s': passes must be strings\n", key.c_str());
+                    return false;
+                }
+                std::string name = pass.get<std::string>();
+                recipe.passes.push_back(name.rfind("--", 0) == 0 ? name : "--" + name);
+            }
+        }else{
+            print_error("Pass recipe '%s' must be an optimization level or an array of passes\n", key.c_str());
+            return false;
+        }
+        recipes[key] = recipe;
+    }
+
+    return true;
+}
+
 args_t supershader::initialize_args(){
     args_t args;
+    args.program_name = "";
+    args.manifest_file = "";
+    args.jobs = 0;
+    args.isolate = false;
+    args.shard = 0;
+    args.shard_count = 0;
+    args.shard_costs = "";
+    args.index_file = "";
+    args.merge_file = "";
+    args.merge_inputs.clear();
+    args.cache_dir = "";
+    args.cache_max_size = 0;
+    args.cache_stats = false;
+    args.depfile = "";
+    args.skip_up_to_date = false;
+    args.scan_deps = "";
+    args.scan_dir = "";
+    args.watch = false;
+    args.profile_passes = "";
+    args.autotune = "";
+    args.autotune_budget = 200;
+    args.server = false;
+    args.server_socket = "";
     args.useBuffers = false;
     args.fileBuffers.clear();
     args.vert_file = "";
@@ -89,17 +365,47 @@ args_t supershader::initialize_args(){
     args.version = 0;
     args.es = false;
     args.platform = PLATFORM_DEFAULT;
+    args.targets.clear();
     args.output_basename = "";
     args.output_dir = "";
     args.output_type = OUTPUT_JSON;
+    args.include_dirs.clear();
     args.include_dir = "";
     args.defines.clear();
+    args.spec_constants.clear();
+    args.variants.clear();
+    args.variant_excludes.clear();
     args.list_includes = false;
+    args.opt_level = OPT_LEVEL_DEFAULT;
+    args.opt_level_explicit = false;
     args.optimization = true;
+    args.pass_recipe = "";
+    args.pass_recipes.clear();
+    args.passes.clear();
 
     return args;
 }
 
+// Library users of older versions set include_dir and optimization
+const args_t& supershader::resolve_deprecated_args(args_t& storage, const args_t& args){
+    if (args.include_dir.empty() && args.optimization)
+        return args;
+
+    storage = args;
+    if (!storage.include_dir.empty()){
+        if (std::find(storage.include_dirs.begin(), storage.include_dirs.end(), storage.include_dir) == storage.include_dirs.end())
+            storage.include_dirs.insert(storage.include_dirs.begin(), storage.include_dir);
+        storage.include_dir = "";
+    }
+    if (!storage.optimization){
+        storage.opt_level = OPT_LEVEL_NONE;
+        storage.opt_level_explicit = true;
+        storage.optimization = true;
+    }
+
+    return storage;
+}
+
 args_t supershader::parse_args(int argc, const char **argv){
     args_t args = initialize_args();
 
@@ -109,14 +415,43 @@ args_t supershader::parse_args(int argc, const char **argv){
     const char *output = NULL;
     const char *output_type = NULL;
     const char *include_dir = NULL;
+    std::vector<std::string> include_dirs;
     const char *defines = NULL;
+    const char *spec = NULL;
+    const char *variants = NULL;
+    const char *exclude_variants = NULL;
     int list_includes = 0;
     int disable_optimization = 0;
+    const char *optimization = NULL;
+    const char *pass_recipe = NULL;
+    const char *profile_passes = NULL;
+    const char *autotune = NULL;
+    int autotune_budget = 0;
+    const char *manifest = NULL;
+    int jobs = 0;
+    int isolate = 0;
+    const char *shard = NULL;
+    const char *shard_costs = NULL;
+    const char *index_file = NULL;
+    const char *merge = NULL;
+    const char *cache_dir = NULL;
+    const char *cache_max_size = NULL;
+    int cache_stats = 0;
+    const char *depfile = NULL;
+    int skip_up_to_date = 0;
+    const char *scan_deps = NULL;
+    const char *scan_dir = NULL;
+    int watch = 0;
+    int server = 0;
+    const char *server_socket = NULL;
 
     static const char *const usage[] = {
     "supershader --vert <vertex shader> [[--] args]",
     "supershader --frag <fragment shader> [[--] args]",
     "supershader --vert <vertex shader> --frag <fragment shader> [[--] args]",
+    "supershader --manifest <programs json> [[--] args]",
+    "supershader --server [--server-socket <path>] [[--] args]",
+    "supershader --merge <index> <shard index>...",
     NULL,
     };
 
@@ -124,13 +459,38 @@ args_t supershader::parse_args(int argc, const char **argv){
         OPT_HELP(),
         OPT_STRING('v', "vert", &vert_file, "vertex shader input file"),
         OPT_STRING('f', "frag", &frag_file, "fragment shader input file"),
-        OPT_STRING('l', "lang", &lang, "<see below> shader language output"),
+        OPT_STRING('l', "lang", &lang, "<see below> shader language output, multiple langs seperated by ','"),
         OPT_STRING('o', "output", &output, "output file template (extension is ignored)"),
         OPT_STRING('t', "output-type", &output_type, "output in json or binary shader format"),
-        OPT_STRING('I', "include-dir", &include_dir, "include search directory"),
+        OPT_STRING('I', "include-dir", &include_dir, "include search directory, can be repeated", append_include_dir, (intptr_t)&include_dirs),
         OPT_STRING('D', "defines", &defines, "preprocessor definitions, seperated by ';'"),
+        OPT_STRING(0, "spec", &spec, "specialization constant values baked at compile time, as name=value seperated by ';'"),
+        OPT_STRING(0, "variants", &variants, "defines to generate all shader permutations, seperated by ';'"),
+        OPT_STRING(0, "exclude-variants", &exclude_variants, "permutations to skip, seperated by ';' with defines seperated by ','"),
         OPT_BOOLEAN('L', "list-includes", &list_includes, "print included files"),
-        OPT_BOOLEAN('d', "disable-optimization", &disable_optimization, "disable shader lang optimizations"),
+        OPT_BOOLEAN('d', "disable-optimization", &disable_optimization, "disable shader lang optimizations, same of -O0"),
+        OPT_STRING('O', "optimization", &optimization, "SPIR-V optimization level: 0, 1 (default), s (size) or perf"),
+        OPT_STRING(0, "pass-recipe", &pass_recipe, "json file with optimization level or spirv-opt passes of each target"),
+        OPT_STRING(0, "autotune", &autotune, "search optimizer passes that give smallest output of each target and write them as pass recipe to this file"),
+        OPT_INTEGER(0, "autotune-budget", &autotune_budget, "recipes tried for each target by --autotune (default: 200)"),
+        OPT_STRING(0, "profile-passes", &profile_passes, "run optimizer passes one by one and write json with time and SPIR-V size of each pass to this file"),
+        OPT_STRING('m', "manifest", &manifest, "json file with programs to compile, other args are used as defaults"),
+        OPT_INTEGER('j', "jobs", &jobs, "number of programs compiled in parallel with --manifest (default: cores)"),
+        OPT_BOOLEAN(0, "isolate", &isolate, "with --manifest, compile each program in a worker process, crashed workers are restarted"),
+        OPT_STRING(0, "shard", &shard, "with --manifest, compile only shard i of N programs, as 'i/N' with i from 0 to N-1"),
+        OPT_STRING(0, "shard-costs", &shard_costs, "batch index with compile times used to balance --shard"),
+        OPT_STRING(0, "index", &index_file, "with --manifest, write a json batch index with result, time and outputs of each program"),
+        OPT_STRING(0, "cache-dir", &cache_dir, "reuse results of previous compiles stored in this directory"),
+        OPT_STRING(0, "cache-max-size", &cache_max_size, "evict least recently used entries when cache is bigger than this size, in bytes or with K, M or G suffix"),
+        OPT_BOOLEAN(0, "cache-stats", &cache_stats, "print cache hits, misses and evictions at end"),
+        OPT_STRING(0, "depfile", &depfile, "write outputs and included files in Make/Ninja depfile format (use 'depfile' of each program with --manifest)"),
+        OPT_BOOLEAN(0, "skip-if-up-to-date", &skip_up_to_date, "do not compile if outputs are newer than inputs and included files"),
+        OPT_STRING(0, "scan-deps", &scan_deps, "write json with included files of each program to this file ('-' for stdout) without compiling"),
+        OPT_STRING(0, "scan-dir", &scan_dir, "with --scan-deps or --autotune, use all shader files of this directory"),
+        OPT_BOOLEAN(0, "watch", &watch, "keep running and compile again programs when their inputs or included files change"),
+        OPT_STRING(0, "merge", &merge, "merge batch indices given as arguments into this file"),
+        OPT_BOOLEAN(0, "server", &server, "keep running and compile json-lines requests from stdin"),
+        OPT_STRING(0, "server-socket", &server_socket, "with --server, read requests from this unix socket instead of stdin"),
         OPT_END(),
     };
 
@@ -163,7 +523,7 @@ args_t supershader::parse_args(int argc, const char **argv){
 
     args.isValid = true;
 
-    if (!vert_file && !frag_file){
+    if (!vert_file && !frag_file && !manifest && !server && !merge && !scan_dir){
         fprintf( stderr, "Missing vertex or fragment shader input\n");
         args.isValid = false;
     }
@@ -177,54 +537,38 @@ args_t supershader::parse_args(int argc, const char **argv){
     }
 
     if (lang){
-        std::string templang = lang;
-        if (templang == "glsl330"){
-            args.lang = LANG_GLSL;
-            args.version = 330;
-        }else if (templang == "glsl410"){
-            args.lang = LANG_GLSL;
-            args.version = 410;
-        }else if (templang == "glsl430"){
-            args.lang = LANG_GLSL;
-            args.version = 430;
-        }else if (templang == "glsl100"){
-            args.lang = LANG_GLSL;
-            args.version = 100;
-            args.es = true;
-        }else if (templang == "glsl300es"){
-            args.lang = LANG_GLSL;
-            args.version = 300;
-            args.es = true;
-        }else if (templang == "hlsl4"){
-            args.lang = LANG_HLSL;
-            args.version = 40;
-        }else if (templang == "hlsl5"){
-            args.lang = LANG_HLSL;
-            args.version = 50;
-        }else if (templang == "msl12macos"){
-            args.lang = LANG_MSL;
-            args.version = 10200;
-            args.platform = PLATFORM_MACOS;
-        }else if (templang == "msl21macos"){
-            args.lang = LANG_MSL;
-            args.version = 20100;
-            args.platform = PLATFORM_MACOS;
-        }else if (templang == "msl12ios"){
-            args.lang = LANG_MSL;
-            args.version = 10200;
-            args.platform = PLATFORM_IOS;
-        }else if (templang == "msl21ios"){
-            args.lang = LANG_MSL;
-            args.version = 20100;
-            args.platform = PLATFORM_IOS;
-        }else{
+        std::stringstream ss(lang);
+        while( ss.good() ){
+            std::string substr;
+            getline( ss, substr, ',' );
+
+            substr = trim(substr);
+            if (substr.empty())
+                continue;
+
+            target_t target;
+            if (parse_lang(target, substr)){
+                args.targets.push_back(target);
+            }else{
+                fprintf( stderr, "Unsupported shader output language: %s\n", substr.c_str());
+                args.isValid = false;
+            }
+        }
+
+        if (args.targets.empty()){
             fprintf( stderr, "Unsupported shader output language: %s\n", lang);
             args.isValid = false;
+        }else{
+            apply_target(args, args.targets[0]);
         }
     } else {
-        args.lang = LANG_GLSL;
-        args.version = 410;
-        fprintf( stdout, "Not defined shader output language, using: glsl410\n");
+        target_t target;
+        parse_lang(target, "glsl410");
+        args.targets.push_back(target);
+        apply_target(args, target);
+        // Server uses stdout for responses
+        if (server == 0 && !merge && !scan_deps)
+            fprintf( stdout, "Not defined shader output language, using: glsl410\n");
     }
 
     if (output){
@@ -248,21 +592,436 @@ args_t supershader::parse_args(int argc, const char **argv){
         args.output_type = OUTPUT_JSON;
     }
 
-    if (include_dir){
-        args.include_dir = include_dir;
-    }
+    args.include_dirs = include_dirs;
 
     if (defines){
         args.defines = parse_defines(defines);
     }
 
+    if (spec){
+        if (!parse_spec_constants(args.spec_constants, spec)){
+            fprintf( stderr, "Specialization constants must be name=value: %s\n", spec);
+            args.isValid = false;
+        }
+    }
+
+    if (variants){
+        args.variants = parse_list(variants, ';');
+    }
+
+    if (exclude_variants){
+        args.variant_excludes = parse_variant_excludes(exclude_variants);
+    }
+
     if (list_includes != 0){
         args.list_includes = true;
     }
 
+    if (optimization){
+        if (!parse_opt_level(args.opt_level, optimization)){
+            fprintf( stderr, "Unsupported optimization level: %s\n", optimization);
+            args.isValid = false;
+        }
+        args.opt_level_explicit = true;
+    }
+
     if (disable_optimization != 0){
-        args.optimization = false;
+        args.opt_level = OPT_LEVEL_NONE;
+        args.opt_level_explicit = true;
+    }
+
+    if (pass_recipe){
+        args.pass_recipe = pass_recipe;
+        if (!load_pass_recipes(args.pass_recipes, args.pass_recipe))
+            args.isValid = false;
+    }
+
+    if (profile_passes){
+        args.profile_passes = profile_passes;
+#if !ENABLE_OPT
+        fprintf( stderr, "--profile-passes needs spirv-opt, build with ENABLE_OPT\n");
+        args.isValid = false;
+#endif
+        // Cached stages and worker processes are not optimized by this process
+        if (cache_dir || isolate){
+            fprintf( stderr, "--profile-passes can not be used with --cache-dir or --isolate\n");
+            args.isValid = false;
+        }
+    }
+
+    if (autotune){
+        args.autotune = autotune;
+#if !ENABLE_OPT
+        fprintf( stderr, "--autotune needs spirv-opt, build with ENABLE_OPT\n");
+        args.isValid = false;
+#endif
+    }
+
+    if (autotune_budget > 0){
+        args.autotune_budget = autotune_budget;
+    }
+
+    if (manifest){
+        args.manifest_file = manifest;
+    }
+
+    args.jobs = jobs;
+
+    if (isolate != 0){
+        args.isolate = true;
+    }
+
+    if (shard){
+        int index = -1;
+        int count = 0;
+        char end;
+        if (sscanf(shard, "%d/%d%c", &index, &count, &end) != 2 || count <= 0 || index < 0 || index >= count){
+            fprintf( stderr, "Invalid shard: %s, expected 'i/N' with i from 0 to N-1\n", shard);
+            args.isValid = false;
+        }else{
+            args.shard = index;
+            args.shard_count = count;
+        }
+    }
+
+    if (shard_costs){
+        args.shard_costs = shard_costs;
+    }
+
+    if (index_file){
+        args.index_file = index_file;
+    }
+
+    if (cache_dir){
+        args.cache_dir = cache_dir;
+    }
+
+    if (cache_max_size){
+        if (!parse_size(args.cache_max_size, cache_max_size) || args.cache_max_size <= 0){
+            fprintf( stderr, "Invalid cache size: %s\n", cache_max_size);
+            args.isValid = false;
+        }
+    }
+
+    if (cache_stats != 0){
+        args.cache_stats = true;
+    }
+
+    if ((cache_max_size || cache_stats) && !cache_dir){
+        fprintf( stderr, "--cache-max-size and --cache-stats need --cache-dir\n");
+        args.isValid = false;
+    }
+
+    if (depfile){
+        args.depfile = depfile;
+    }
+
+    if (skip_up_to_date != 0){
+        args.skip_up_to_date = true;
+    }
+
+    if (scan_deps){
+        args.scan_deps = scan_deps;
+    }
+
+    if (watch != 0){
+        args.watch = true;
+    }
+
+    if (scan_dir){
+        args.scan_dir = scan_dir;
+        if (!scan_deps && !autotune){
+            fprintf( stderr, "--scan-dir needs --scan-deps or --autotune\n");
+            args.isValid = false;
+        }
+    }
+
+    if (merge){
+        args.merge_file = merge;
+        for (int i = 0; i < argc; i++){
+            args.merge_inputs.push_back(argv[i]);
+        }
+        if (args.merge_inputs.empty()){
+            fprintf( stderr, "Missing batch indices to merge\n");
+            args.isValid = false;
+        }
+    }
+
+    if (server != 0){
+        args.server = true;
+    }
+
+    if (server_socket){
+        args.server_socket = server_socket;
     }
 
     return args;
-}
\ No newline at end of file
+}
+
+static std::string resolve_path(const std::string& basedir, const std::string& path){
+    if (basedir.empty() || path.empty())
+        return path;
+    if (path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':'))
+        return path;
+
+    return basedir + kPathSeparator + path;
+}
+
+static bool get_manifest_string(std::string& value, const json& j, const char* key, const std::string& program){
+    if (!j.contains(key))
+        return false;
+
+    if (j[key].is_string()){
+        value = j[key].get<std::string>();
+    }else if (j[key].is_array()){
+        // Arrays are joined with separator used by command line
+        std::string separator = (std::string(key) == "lang") ? "," : ";";
+        value = "";
+        for (const json& item : j[key]){
+            if (!item.is_string())
+                continue;
+            if (!value.empty())
+                value += separator;
+            value += item.get<std::string>();
+        }
+    }else{
+        print_error("Program '%s': '%s' must be a string or an array of strings\n", program.c_str(), key);
+        return false;
+    }
+
+    return true;
+}
+
+static bool parse_manifest_program(args_t& program, const json& pj, const std::string& basedir, bool need_output){
+    if (!pj.is_object()){
+        print_error("Programs must be objects\n");
+        return false;
+    }
+
+    std::string value;
+
+    if (get_manifest_string(value, pj, "name", "")){
+        program.program_name = value;
+    }
+    if (get_manifest_string(value, pj, "output", program.program_name)){
+        std::string output = resolve_path(basedir, value);
+        program.output_basename = get_filename(output.c_str());
+        program.output_dir = get_directory(output.c_str()) + kPathSeparator;
+    }else if (!need_output){
+        program.output_basename = "output";
+    }else if (!program.program_name.empty()){
+        std::string output = resolve_path(basedir, program.program_name);
+        program.output_basename = get_filename(output.c_str());
+        program.output_dir = get_directory(output.c_str()) + kPathSeparator;
+    }else{
+        print_error("Program needs a 'name' or an 'output'\n");
+        return false;
+    }
+    if (program.program_name.empty()){
+        program.program_name = program.output_basename;
+    }
+
+    const std::string& name = program.program_name;
+
+    program.vert_file = "";
+    program.frag_file = "";
+    if (get_manifest_string(value, pj, "vert", name)){
+        program.vert_file = resolve_path(basedir, value);
+    }
+    if (get_manifest_string(value, pj, "frag", name)){
+        program.frag_file = resolve_path(basedir, value);
+    }
+    if (program.vert_file.empty() && program.frag_file.empty()){
+        print_error("Program '%s': missing vertex or fragment shader input\n", name.c_str());
+        return false;
+    }
+
+    if (get_manifest_string(value, pj, "lang", name)){
+        program.targets.clear();
+        std::stringstream ss(value);
+        while( ss.good() ){
+            std::string substr;
+            getline( ss, substr, ',' );
+
+            substr = trim(substr);
+            if (substr.empty())
+                continue;
+
+            target_t target;
+            if (!parse_lang(target, substr)){
+                print_error("Program '%s': unsupported shader output language: %s\n", name.c_str(), substr.c_str());
+                return false;
+            }
+            program.targets.push_back(target);
+        }
+        if (program.targets.empty()){
+            print_error("Program '%s': missing shader output language\n", name.c_str());
+            return false;
+        }
+        apply_target(program, program.targets[0]);
+    }
+
+    if (get_manifest_string(value, pj, "output_type", name)){
+        if (value == "json"){
+            program.output_type = OUTPUT_JSON;
+        } else if (value == "binary"){
+            program.output_type = OUTPUT_BINARY;
+        }else{
+            print_error("Program '%s': unsupported output type: %s\n", name.c_str(), value.c_str());
+            return false;
+        }
+    }
+
+    // Each program has its own dependencies
+    program.depfile = "";
+    if (get_manifest_string(value, pj, "depfile", name)){
+        program.depfile = resolve_path(basedir, value);
+    }
+
+    if (get_manifest_string(value, pj, "include_dir", name)){
+        program.include_dirs.clear();
+        for (const std::string& dir : parse_list(value, ';')){
+            program.include_dirs.push_back(resolve_path(basedir, dir));
+        }
+    }
+
+    if (get_manifest_string(value, pj, "defines", name)){
+        program.defines = parse_defines(value.c_str());
+    }
+
+    if (get_manifest_string(value, pj, "spec", name)){
+        if (!parse_spec_constants(program.spec_constants, value)){
+            print_error("Program '%s': specialization constants must be name=value: %s\n", name.c_str(), value.c_str());
+            return false;
+        }
+    }
+
+    if (get_manifest_string(value, pj, "variants", name)){
+        program.variants = parse_list(value, ';');
+    }
+
+    if (pj.contains("exclude_variants")){
+        program.variant_excludes.clear();
+        const json& ej = pj["exclude_variants"];
+        if (ej.is_string()){
+            program.variant_excludes = parse_variant_excludes(ej.get<std::string>());
+        }else if (ej.is_array()){
+            // Each rule is "A,B" or ["A", "B"]
+            for (const json& rule : ej){
+                if (rule.is_string()){
+                    program.variant_excludes.push_back(parse_list(rule.get<std::string>(), ','));
+                }else if (rule.is_array()){
+                    std::vector<std::string> defs;
+                    for (const json& def : rule){
+                        if (def.is_string())
+                            defs.push_back(def.get<std::string>());
+                    }
+                    program.variant_excludes.push_back(defs);
+                }
+            }
+        }
+    }
+
+    if (pj.contains("disable_optimization") && pj["disable_optimization"].is_boolean()){
+        if (pj["disable_optimization"].get<bool>()){
+            program.opt_level = OPT_LEVEL_NONE;
+            program.opt_level_explicit = true;
+        }else if (program.opt_level == OPT_LEVEL_NONE){
+            program.opt_level = OPT_LEVEL_DEFAULT;
+            program.opt_level_explicit = false;
+        }
+    }
+
+    if (get_manifest_string(value, pj, "optimization", name)){
+        if (!parse_opt_level(program.opt_level, value)){
+            print_error("Program '%s': unsupported optimization level: %s\n", name.c_str(), value.c_str());
+            return false;
+        }
+        program.opt_level_explicit = true;
+    }
+
+    if (get_manifest_string(value, pj, "pass_recipe", name)){
+        program.pass_recipe = resolve_path(basedir, value);
+        if (!load_pass_recipes(program.pass_recipes, program.pass_recipe))
+            return false;
+    }
+
+    return true;
+}
+
+bool supershader::load_manifest(std::vector<args_t>& programs, const args_t& args){
+    std::ifstream ifs(args.manifest_file);
+    if (!ifs.is_open()){
+        fprintf(stderr, "Unable to open file: %s\n", args.manifest_file.c_str());
+        return false;
+    }
+
+    json j = json::parse(ifs, nullptr, false);
+    if (j.is_discarded()){
+        fprintf(stderr, "Invalid json in manifest: %s\n", args.manifest_file.c_str());
+        return false;
+    }
+
+    // Manifest may be an array of programs or an object with "programs" array
+    const json& pjs = (j.is_object() && j.contains("programs")) ? j["programs"] : j;
+    if (!pjs.is_array()){
+        fprintf(stderr, "Manifest must have an array of programs: %s\n", args.manifest_file.c_str());
+        return false;
+    }
+
+    // Manifest paths are relative to manifest location
+    std::string basedir;
+    if (args.manifest_file.find_last_of("/\\") != std::string::npos){
+        basedir = get_directory(args.manifest_file.c_str());
+    }
+
+    // Name is key of program in summary, shards and batch indices
+    std::set<std::string> names;
+
+    for (const json& pj : pjs){
+        // Manifest is kept, programs depend on it
+        args_t program = args;
+        if (!parse_manifest_program(program, pj, basedir, true))
+            return false;
+
+        if (!names.insert(program.program_name).second){
+            fprintf(stderr, "Program name '%s' is used by more than one program, set a unique 'name': %s\n", program.program_name.c_str(), args.manifest_file.c_str());
+            return false;
+        }
+
+        programs.push_back(program);
+    }
+
+    return true;
+}
+
+bool supershader::load_request(args_t& request, const std::string& request_json, const args_t& args){
+    json j = json::parse(request_json, nullptr, false);
+    if (j.is_discarded() || !j.is_object()){
+        print_error("Invalid json in request\n");
+        return false;
+    }
+
+    request = args;
+    request.server = false;
+    request.variants.clear();
+    request.variant_excludes.clear();
+    if (!parse_manifest_program(request, j, "", false))
+        return false;
+
+    // Sources can be sent with request, so no file is read
+    if (j.contains("fileBuffers")){
+        if (!j["fileBuffers"].is_object()){
+            print_error("Request 'fileBuffers' must be an object\n");
+            return false;
+        }
+        request.useBuffers = true;
+        request.fileBuffers.clear();
+        for (auto& [name, content] : j["fileBuffers"].items()){
+            if (content.is_string())
+                request.fileBuffers[name] = content.get<std::string>();
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,393 @@
+//
+// (c) 2024 Eduardo Doria.
+//
+
+#include "supershader.h"
+
+#include "nlohmann/json.hpp"
+#include <map>
+#include <chrono>
+#include <filesystem>
+#include <algorithm>
+
+using namespace supershader;
+
+using json = nlohmann::ordered_json;
+
+// Passes that break WebGL1 and HLSL shaders are not tried with them
+static const char* ConservativeExcluded[] = {"--merge-return", "--inline-entry-points-exhaustive", "--inline-entry-points-opaque", "--merge-blocks", "--eliminate-local-multi-store", "--ssa-rewrite"};
+
+// Optimizer time is noisy, a recipe with same output must be faster by this ratio
+static const double AutotuneTimeRatio = 0.95;
+static const size_t AutotuneMaxRepeat = 3;
+static const size_t AutotuneMaxPasses = 128;
+
+struct autotune_sample_t{
+    target_t target;
+    args_t args;
+    std::vector<input_t> inputs;
+    // Referenced defines of stages, scanned once for all recipes
+    std::vector<std::set<std::string>> macros;
+    // Not optimized, each recipe starts from it
+    std::vector<spirv_t> spirvvec;
+};
+
+struct autotune_score_t{
+    bool valid = false;
+    uint64_t statements = 0;
+    uint64_t words = 0;
+    double time_ms = 0;
+};
+
+struct autotune_recipe_t{
+    std::string level;
+    std::vector<std::string> passes;
+    autotune_score_t score;
+};
+
+static bool is_conservative_excluded(const std::string& pass){
+    for (const char* excluded : ConservativeExcluded){
+        if (pass == excluded || pass.rfind(std::string(excluded) + "=", 0) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Pairs name.vert and name.frag of directory as one program
+static void get_directory_programs(std::vector<args_t>& programs, const args_t& args){
+    namespace fs = std::filesystem;
+    std::error_code ec;
+
+    std::map<std::string, args_t> stems;
+    for (fs::recursive_directory_iterator it(args.scan_dir, ec), end; !ec && it != end; it.increment(ec)){
+        if (!it->is_regular_file())
+            continue;
+
+        std::string extension = it->path().extension().string();
+        std::string stem = (it->path().parent_path() / it->path().stem()).generic_string();
+        if (extension == ".vert" || extension == ".vs" || extension == ".frag" || extension == ".fs"){
+            auto found = stems.find(stem);
+            if (found == stems.end()){
+                found = stems.emplace(stem, args).first;
+                found->second.program_name = stem;
+                found->second.vert_file = "";
+                found->second.frag_file = "";
+            }
+            if (extension == ".vert" || extension == ".vs"){
+                found->second.vert_file = it->path().generic_string();
+            }else{
+                found->second.frag_file = it->path().generic_string();
+            }
+        }
+    }
+    if (ec)
+        print_error("Unable to scan directory %s: %s\n", args.scan_dir.c_str(), ec.message().c_str());
+
+    for (auto& [stem, program] : stems){
+        programs.push_back(program);
+    }
+}
+
+// Front-end runs once, without optimization, for each program and target
+static void get_samples(std::map<std::string, std::vector<autotune_sample_t>>& samples, const std::vector<args_t>& programs, const args_t& args){
+    std::vector<std::vector<std::pair<std::string, autotune_sample_t>>> programsamples(programs.size());
+    std::vector<char> results(programs.size(), 0);
+    run_parallel(results, args.jobs, [&](size_t p){
+        args_t program = programs[p];
+        program.cache_dir = "";
+        program.profile_passes = "";
+
+        std::vector<input_t> inputs;
+        if (!load_input(inputs, program))
+            return false;
+
+        std::vector<std::set<std::string>> macros;
+        get_stage_macros(macros, inputs, program);
+
+        std::vector<target_t> targets = get_targets(program);
+        std::vector<args_t> targetargs = get_target_args(program);
+        std::map<std::string, std::vector<spirv_t>> spirvs;
+        for (size_t t = 0; t < targets.size(); t++){
+            targetargs[t].opt_level = OPT_LEVEL_NONE;
+            targetargs[t].passes.clear();
+
+            std::string preamble = get_lang_preamble(targetargs[t]);
+            if (spirvs.find(preamble) == spirvs.end()){
+                std::vector<spirv_t>& spirvvec = spirvs[preamble];
+                spirvvec.resize(inputs.size());
+                std::set<std::string> included_files;
+                if (!compile_to_spirv(spirvvec, included_files, inputs, targetargs[t])){
+                    print_error("Program '%s' does not compile, it is not used\n", program.program_name.c_str());
+                    return false;
+                }
+            }
+
+            autotune_sample_t sample;
+            sample.target = targets[t];
+            sample.args = targetargs[t];
+            sample.inputs = inputs;
+            sample.macros = macros;
+            sample.spirvvec = spirvs[preamble];
+            programsamples[p].push_back({targets[t].name, sample});
+        }
+
+        return true;
+    });
+
+    for (size_t p = 0; p < programs.size(); p++){
+        for (auto& [target, sample] : programsamples[p]){
+            samples[target].push_back(sample);
+        }
+    }
+}
+
+// Cross-compiled source is measured by its statements
+static uint64_t count_statements(const std::string& source){
+    return std::count(source.begin(), source.end(), ';');
+}
+
+static bool evaluate_sample(autotune_score_t& score, const std::vector<std::string>& passes, const autotune_sample_t& sample){
+    args_t args = sample.args;
+    args.passes = passes;
+
+    std::vector<spirv_t> spirvvec = sample.spirvvec;
+
+    auto start = std::chrono::steady_clock::now();
+    for (spirv_t& spirv : spirvvec){
+        if (!optimize_spirv(spirv, args))
+            return false;
+    }
+    score.time_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<spirvcross_t> spirvcrossvec(sample.inputs.size());
+    if (!compile_to_lang(spirvcrossvec, spirvvec, sample.inputs, sample.macros, args))
+        return false;
+
+    for (size_t i = 0; i < spirvvec.size(); i++){
+        score.words += spirvvec[i].bytecode.size();
+        score.statements += count_statements(spirvcrossvec[i].source);
+    }
+    score.valid = true;
+
+    return true;
+}
+
+static autotune_score_t evaluate(const std::vector<std::string>& passes, const std::vector<autotune_sample_t>& samples, const args_t& args){
+    std::vector<autotune_score_t> scores(samples.size());
+    std::vector<char> results(samples.size(), 0);
+    bool success = run_parallel(results, args.jobs, [&](size_t i){
+        // Recipes that break shaders are expected, their errors are not printed
+        std::string capture;
+        std::string* previous = get_output_capture();
+        set_output_capture(&capture);
+        bool valid = evaluate_sample(scores[i], passes, samples[i]);
+        set_output_capture(previous);
+        return valid;
+    });
+
+    autotune_score_t total;
+    if (!success)
+        return total;
+
+    for (const autotune_score_t& score : scores){
+        total.statements += score.statements;
+        total.words += score.words;
+        total.time_ms += score.time_ms;
+    }
+    total.valid = true;
+
+    return total;
+}
+
+// Smaller output first, then smaller SPIR-V, then faster optimizer
+static bool is_better(const autotune_score_t& a, const autotune_score_t& b){
+    if (!a.valid)
+        return false;
+    if (!b.valid)
+        return true;
+    if (a.statements != b.statements)
+        return a.statements < b.statements;
+    if (a.words != b.words)
+        return a.words < b.words;
+
+    return a.time_ms < b.time_ms * AutotuneTimeRatio;
+}
+
+// Recipes that differ from passes by one change: removed, repeated, swapped or inserted pass, or whole recipe repeated
+static std::vector<std::vector<std::string>> get_neighbors(const std::vector<std::string>& passes, const std::vector<std::string>& pool){
+    std::vector<std::vector<std::string>> neighbors;
+
+    for (size_t i = 0; i < passes.size(); i++){
+        std::vector<std::string> removed = passes;
+        removed.erase(removed.begin() + i);
+        neighbors.push_back(removed);
+    }
+
+    if (passes.size() < AutotuneMaxPasses){
+        for (size_t i = 0; i < passes.size(); i++){
+            size_t repeats = 1;
+            while (i + repeats < passes.size() && passes[i + repeats] == passes[i])
+                repeats++;
+            if (repeats < AutotuneMaxRepeat){
+                std::vector<std::string> repeated = passes;
+                repeated.insert(repeated.begin() + i, passes[i]);
+                neighbors.push_back(repeated);
+            }
+            i += repeats - 1;
+        }
+    }
+
+    for (size_t i = 0; i + 1 < passes.size(); i++){
+        if (passes[i] == passes[i + 1])
+            continue;
+        std::vector<std::string> swapped = passes;
+        std::swap(swapped[i], swapped[i + 1]);
+        neighbors.push_back(swapped);
+    }
+
+    // Last pass is usually a cleanup, new passes go before it
+    if (passes.size() < AutotuneMaxPasses){
+        size_t position = passes.empty() ? 0 : passes.size() - 1;
+        for (const std::string& pass : pool){
+            std::vector<std::string> inserted = passes;
+            inserted.insert(inserted.begin() + position, pass);
+            neighbors.push_back(inserted);
+        }
+    }
+
+    if (!passes.empty() && passes.size() * 2 <= AutotuneMaxPasses){
+        std::vector<std::string> twice = passes;
+        twice.insert(twice.end(), passes.begin(), passes.end());
+        neighbors.push_back(twice);
+    }
+
+    return neighbors;
+}
+
+static std::string join_passes(const std::vector<std::string>& passes){
+    std::string joined;
+    for (const std::string& pass : passes){
+        joined += pass + " ";
+    }
+    return joined;
+}
+
+static void print_score(const char* name, const autotune_score_t& score){
+    if (score.valid){
+        fprintf(stdout, "  %s: %llu statements, %llu SPIR-V words, %.1f ms\n", name, (unsigned long long)score.statements, (unsigned long long)score.words, score.time_ms);
+    }else{
+        fprintf(stdout, "  %s: failed\n", name);
+    }
+}
+
+static bool autotune_target(autotune_recipe_t& best, const std::string& target, const std::vector<autotune_sample_t>& samples, const args_t& args){
+    bool conservative = needs_conservative_passes(samples[0].target);
+
+    // Levels are starting points and their passes are the pool of passes to try
+    std::vector<autotune_recipe_t> seeds;
+    std::vector<std::string> pool;
+    for (opt_level_t level : {OPT_LEVEL_DEFAULT, OPT_LEVEL_SIZE, OPT_LEVEL_PERF}){
+        args_t levelargs = samples[0].args;
+        levelargs.opt_level = level;
+        levelargs.passes.clear();
+
+        autotune_recipe_t seed;
+        seed.level = get_optimization_key(levelargs);
+        if (!get_optimization_passes(seed.passes, levelargs))
+            return false;
+
+        for (const std::string& pass : seed.passes){
+            if (std::find(pool.begin(), pool.end(), pass) == pool.end() && !(conservative && is_conservative_excluded(pass)))
+                pool.push_back(pass);
+        }
+
+        if (conservative && level != OPT_LEVEL_DEFAULT)
+            continue;
+        seeds.push_back(seed);
+    }
+
+    std::set<std::string> tried;
+    int evaluations = 0;
+    for (autotune_recipe_t& seed : seeds){
+        seed.score = evaluate(seed.passes, samples, args);
+        tried.insert(join_passes(seed.passes));
+        evaluations++;
+        if (seed.level == "O1" || is_better(seed.score, best.score))
+            best = seed;
+    }
+
+    fprintf(stdout, "%s: %i samples\n", target.c_str(), (int)samples.size());
+    print_score("O1", seeds[0].score);
+
+    // Hill climbing, first better neighbor is taken until no neighbor is better or budget is used
+    bool improved = true;
+    while (improved && evaluations < args.autotune_budget){
+        improved = false;
+        for (const std::vector<std::string>& candidate : get_neighbors(best.passes, pool)){
+            if (evaluations >= args.autotune_budget)
+                break;
+            if (!tried.insert(join_passes(candidate)).second)
+                continue;
+
+            autotune_score_t score = evaluate(candidate, samples, args);
+            evaluations++;
+            if (is_better(score, best.score)){
+                best.level = "";
+                best.passes = candidate;
+                best.score = score;
+                improved = true;
+                break;
+            }
+        }
+    }
+
+    print_score(best.level.empty() ? "tuned" : best.level.c_str(), best.score);
+    fprintf(stdout, "  %i recipes tried, %i passes\n", evaluations, (int)best.passes.size());
+    fflush(stdout);
+
+    return best.score.valid;
+}
+
+bool supershader::autotune_passes(const std::vector<args_t>& programs, const args_t& args){
+    process_reference_t process;
+
+    std::vector<args_t> corpus = programs;
+    if (!args.scan_dir.empty())
+        get_directory_programs(corpus, args);
+
+    std::map<std::string, std::vector<autotune_sample_t>> samples;
+    get_samples(samples, corpus, args);
+    if (samples.empty()){
+        print_error("No shaders to autotune\n");
+        return false;
+    }
+
+    // Recipe of each target, in format of --pass-recipe
+    json j;
+    bool success = true;
+    for (const auto& [target, targetsamples] : samples){
+        autotune_recipe_t best;
+        if (!autotune_target(best, target, targetsamples, args)){
+            print_error("Target %s: no recipe compiles all samples\n", target.c_str());
+            success = false;
+            continue;
+        }
+
+        if (best.level.empty()){
+            std::vector<std::string> passes;
+            for (const std::string& pass : best.passes){
+                passes.push_back(pass.substr(2));
+            }
+            j[target] = passes;
+        }else{
+            j[target] = best.level;
+        }
+    }
+
+    if (!write_output_file(args.autotune, j.dump(4) + "\n")){
+        print_error("Writing to file %s failed\n", args.autotune.c_str());
+        return false;
+    }
+
+    return success;
+}
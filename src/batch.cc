@@ -0,0 +1,529 @@
+//
+// (c) 2024 Eduardo Doria.
+//
+
+#include "supershader.h"
+
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#endif
+
+using namespace supershader;
+
+// Set in threads of a pool with more than one task
+static thread_local bool in_parallel_pool = false;
+
+bool supershader::run_parallel(std::vector<char>& results, int jobs, const std::function<bool(size_t)>& task){
+    if (jobs <= 0)
+        jobs = (int)std::thread::hardware_concurrency();
+    if (jobs <= 0)
+        jobs = 1;
+    if (jobs > (int)results.size())
+        jobs = (int)results.size();
+    // Nested calls run inline, outer pool already has its jobs
+    if (in_parallel_pool)
+        jobs = 1;
+
+    std::atomic<size_t> next(0);
+    std::string* capture = get_output_capture();
+    bool pooled = (results.size() > 1);
+
+    // Fixed size pool, each worker takes the next task until all are done
+    auto worker = [&](){
+        set_output_capture(capture);
+        bool was_pooled = in_parallel_pool;
+        in_parallel_pool = was_pooled || pooled;
+        size_t i;
+        while ((i = next++) < results.size()){
+            results[i] = task(i);
+        }
+        in_parallel_pool = was_pooled;
+    };
+
+    // Caller has its own token, each extra thread needs one from make jobserver
+    auto token_worker = [&](){
+        char token;
+        if (!jobserver_acquire(token, [&](){ return next < results.size(); }))
+            return;
+        worker();
+        jobserver_release(token);
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < jobs; t++){
+        if (jobserver_enabled()){
+            threads.emplace_back(token_worker);
+        }else{
+            threads.emplace_back(worker);
+        }
+    }
+    worker();
+    for (std::thread& thread : threads){
+        thread.join();
+    }
+
+    for (size_t i = 0; i < results.size(); i++){
+        if (!results[i])
+            return false;
+    }
+
+    return true;
+}
+
+static bool print_batch_summary(const std::vector<args_t>& programs, const std::vector<char>& results){
+    int failed = 0;
+    fprintf(stdout, "Programs:\n");
+    for (int i = 0; i < programs.size(); i++){
+        fprintf(stdout, "  %s: %s\n", programs[i].program_name.c_str(), results[i] ? "success" : "failed");
+        if (!results[i])
+            failed++;
+    }
+    fprintf(stdout, "%i programs, %i succeeded, %i failed\n", (int)programs.size(), (int)programs.size() - failed, failed);
+
+    return failed == 0;
+}
+
+#ifndef _WIN32
+
+// Max worker restarts before giving up the batch
+static const int MaxWorkerRestarts = 16;
+
+struct worker_t{
+    pid_t pid = -1;
+    int job_fd = -1;
+    int result_fd = -1;
+    int job = -1;
+    std::chrono::steady_clock::time_point start;
+    bool has_token = false;
+    char token = 0;
+};
+
+static bool write_fd(int fd, const void* data, size_t size){
+    const char* ptr = (const char*)data;
+    while (size > 0){
+        ssize_t n = write(fd, ptr, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        ptr += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool read_fd(int fd, void* data, size_t size){
+    char* ptr = (char*)data;
+    while (size > 0){
+        ssize_t n = read(fd, ptr, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        ptr += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool write_string(int fd, const std::string& str){
+    uint32_t size = (uint32_t)str.size();
+    return write_fd(fd, &size, sizeof(size)) && write_fd(fd, str.data(), size);
+}
+
+static bool read_string(int fd, std::string& str){
+    uint32_t size;
+    if (!read_fd(fd, &size, sizeof(size)))
+        return false;
+    str.resize(size);
+    return read_fd(fd, &str[0], size);
+}
+
+static cache_stats_t subtract_cache_stats(const cache_stats_t& a, const cache_stats_t& b){
+    cache_stats_t stats;
+    stats.program_hits = a.program_hits - b.program_hits;
+    stats.program_misses = a.program_misses - b.program_misses;
+    stats.stage_hits = a.stage_hits - b.stage_hits;
+    stats.stage_misses = a.stage_misses - b.stage_misses;
+    stats.evictions = a.evictions - b.evictions;
+    return stats;
+}
+
+static void run_worker(const std::vector<args_t>& programs, int job_fd, int result_fd){
+    Compiler compiler;
+
+    // Counters are inherited from coordinator, only changes are sent
+    cache_stats_t sentstats = get_cache_stats();
+
+    uint32_t index;
+    while (read_fd(job_fd, &index, sizeof(index))){
+        const args_t& program = programs[index];
+
+        compile_result_t result;
+        if (!program.variants.empty()){
+            // Variants map is written by the worker itself
+            set_output_capture(&result.diagnostics);
+            result.success = compile_program(program);
+            set_output_capture(nullptr);
+        }else{
+            result = compiler.compile(program);
+        }
+
+        cache_stats_t stats = get_cache_stats();
+        cache_stats_t cachestats = subtract_cache_stats(stats, sentstats);
+        sentstats = stats;
+
+        // Reply: index, success, diagnostics, cache counters, reflection with inline source of each target, then included files
+        uint8_t success = result.success ? 1 : 0;
+        uint32_t count = (uint32_t)result.targets.size();
+        bool sent = write_fd(result_fd, &index, sizeof(index)) &&
+                    write_fd(result_fd, &success, sizeof(success)) &&
+                    write_string(result_fd, result.diagnostics) &&
+                    write_fd(result_fd, &cachestats, sizeof(cachestats)) &&
+                    write_fd(result_fd, &count, sizeof(count));
+        for (uint32_t t = 0; sent && t < count; t++){
+            sent = write_string(result_fd, result.targets[t].json);
+        }
+        uint32_t includecount = (uint32_t)result.included_files.size();
+        sent = sent && write_fd(result_fd, &includecount, sizeof(includecount));
+        for (auto it = result.included_files.begin(); sent && it != result.included_files.end(); ++it){
+            sent = write_string(result_fd, *it);
+        }
+        if (!sent)
+            break;
+    }
+
+    close(job_fd);
+    close(result_fd);
+}
+
+static void close_worker(worker_t& worker){
+    if (worker.job_fd >= 0)
+        close(worker.job_fd);
+    if (worker.result_fd >= 0)
+        close(worker.result_fd);
+
+    worker.job_fd = -1;
+    worker.result_fd = -1;
+}
+
+static bool spawn_worker(worker_t& worker, std::vector<worker_t>& workers, const std::vector<args_t>& programs){
+    int job_pipe[2];
+    int result_pipe[2];
+    if (pipe(job_pipe) < 0){
+        print_error("Unable to create worker pipe: %s\n", strerror(errno));
+        return false;
+    }
+    if (pipe(result_pipe) < 0){
+        print_error("Unable to create worker pipe: %s\n", strerror(errno));
+        close(job_pipe[0]);
+        close(job_pipe[1]);
+        return false;
+    }
+
+    // Buffered output would be written again by the child
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid < 0){
+        print_error("Unable to fork worker: %s\n", strerror(errno));
+        close(job_pipe[0]);
+        close(job_pipe[1]);
+        close(result_pipe[0]);
+        close(result_pipe[1]);
+        return false;
+    }
+
+    if (pid == 0){
+        // Other workers only see end of jobs if their pipes are closed here too
+        for (worker_t& other : workers){
+            close_worker(other);
+        }
+        close(job_pipe[1]);
+        close(result_pipe[0]);
+
+        run_worker(programs, job_pipe[0], result_pipe[1]);
+
+        _exit(0);
+    }
+
+    close(job_pipe[0]);
+    close(result_pipe[1]);
+
+    worker.pid = pid;
+    worker.job_fd = job_pipe[1];
+    worker.result_fd = result_pipe[0];
+    worker.job = -1;
+
+    return true;
+}
+
+static void reap_worker(worker_t& worker, const std::string& program_name){
+    close_worker(worker);
+
+    int status = 0;
+    while (waitpid(worker.pid, &status, 0) < 0 && errno == EINTR);
+
+    if (WIFSIGNALED(status)){
+        print_error("Worker %i crashed with signal %i (%s) while compiling %s\n", (int)worker.pid, WTERMSIG(status), strsignal(WTERMSIG(status)), program_name.c_str());
+    }else{
+        print_error("Worker %i exited with status %i while compiling %s\n", (int)worker.pid, WEXITSTATUS(status), program_name.c_str());
+    }
+
+    worker.pid = -1;
+    worker.job = -1;
+}
+
+static bool read_worker_result(worker_t& worker, const std::vector<args_t>& programs, std::vector<char>& results, std::vector<double>& times){
+    uint32_t index;
+    uint8_t success;
+    std::string diagnostics;
+    cache_stats_t cachestats;
+    uint32_t count;
+    if (!read_fd(worker.result_fd, &index, sizeof(index)) ||
+        !read_fd(worker.result_fd, &success, sizeof(success)) ||
+        !read_string(worker.result_fd, diagnostics) ||
+        !read_fd(worker.result_fd, &cachestats, sizeof(cachestats)) ||
+        !read_fd(worker.result_fd, &count, sizeof(count)) ||
+        index != (uint32_t)worker.job){
+        return false;
+    }
+
+    add_cache_stats(cachestats);
+
+    const args_t& program = programs[index];
+
+    std::vector<target_t> targets = get_targets(program);
+    std::vector<target_result_t> targetresults(count);
+    for (uint32_t t = 0; t < count; t++){
+        std::string buffer;
+        if (!read_string(worker.result_fd, buffer))
+            return false;
+
+        if (t < targets.size())
+            targetresults[t].target = targets[t];
+        if (!parse_json_buffer(targetresults[t].spirvcrossvec, targetresults[t].inputs, buffer))
+            success = 0;
+    }
+
+    uint32_t includecount;
+    if (!read_fd(worker.result_fd, &includecount, sizeof(includecount)))
+        return false;
+    std::set<std::string> included_files;
+    for (uint32_t f = 0; f < includecount; f++){
+        std::string file;
+        if (!read_string(worker.result_fd, file))
+            return false;
+        included_files.insert(file);
+    }
+
+    fputs(diagnostics.c_str(), success ? stdout : stderr);
+
+    // Outputs are written only by coordinator
+    if (success && count > 0)
+        success = write_program_results(targetresults, included_files, program) ? 1 : 0;
+
+    results[index] = success;
+    times[index] = std::chrono::duration<double>(std::chrono::steady_clock::now() - worker.start).count();
+    worker.job = -1;
+
+    return true;
+}
+
+static bool compile_batch_isolated(const std::vector<args_t>& programs, int jobs, std::vector<char>& results, std::vector<double>& times){
+    if (jobs <= 0)
+        jobs = (int)std::thread::hardware_concurrency();
+    if (jobs <= 0)
+        jobs = 1;
+    if (jobs > (int)programs.size())
+        jobs = (int)programs.size();
+
+    // Jobs can be written to a worker that just died
+    signal(SIGPIPE, SIG_IGN);
+
+    // Workers are forked with glslang process already initialized
+    process_reference_t process;
+
+    // First worker uses our own token, with make jobserver the others start when a token is granted
+    std::vector<worker_t> workers(jobs);
+    for (int w = 0; w < jobs; w++){
+        if (w > 0 && jobserver_enabled())
+            break;
+        if (!spawn_worker(workers[w], workers, programs))
+            return false;
+    }
+
+    size_t next = 0;
+    size_t done = 0;
+    int restarts = 0;
+    bool aborted = false;
+
+    while (done < programs.size() && !aborted){
+        bool waiting_token = false;
+        for (worker_t& worker : workers){
+            if (worker.pid >= 0 || !jobserver_enabled() || next >= programs.size())
+                continue;
+
+            if (!worker.has_token && !jobserver_try_acquire(worker.token)){
+                waiting_token = true;
+                break;
+            }
+            worker.has_token = true;
+            if (!spawn_worker(worker, workers, programs)){
+                jobserver_release(worker.token);
+                worker.has_token = false;
+                break;
+            }
+        }
+
+        for (worker_t& worker : workers){
+            if (worker.pid < 0 || worker.job >= 0 || next >= programs.size())
+                continue;
+
+            uint32_t index = (uint32_t)next++;
+            worker.job = (int)index;
+            worker.start = std::chrono::steady_clock::now();
+            // If worker is already dead, its read will fail and the job is reported as crashed
+            write_fd(worker.job_fd, &index, sizeof(index));
+        }
+
+        std::vector<pollfd> fds;
+        std::vector<worker_t*> polled;
+        for (worker_t& worker : workers){
+            if (worker.pid >= 0 && worker.job >= 0){
+                fds.push_back({worker.result_fd, POLLIN, 0});
+                polled.push_back(&worker);
+            }
+        }
+        if (fds.empty())
+            break;
+
+        if (poll(fds.data(), fds.size(), waiting_token ? JobserverPollMs : -1) < 0){
+            if (errno == EINTR)
+                continue;
+            print_error("Unable to poll workers: %s\n", strerror(errno));
+            aborted = true;
+            break;
+        }
+
+        for (size_t f = 0; f < fds.size(); f++){
+            if (fds[f].revents == 0)
+                continue;
+
+            worker_t& worker = *polled[f];
+            int job = worker.job;
+            done++;
+
+            if (read_worker_result(worker, programs, results, times))
+                continue;
+
+            results[job] = 0;
+            reap_worker(worker, programs[job].program_name);
+
+            if (++restarts > MaxWorkerRestarts){
+                print_error("Too many worker crashes, stopping batch\n");
+                aborted = true;
+                continue;
+            }
+            if (!spawn_worker(worker, workers, programs))
+                aborted = true;
+        }
+    }
+
+    // Closing job pipes makes idle workers exit
+    for (worker_t& worker : workers){
+        if (worker.pid >= 0){
+            close_worker(worker);
+            while (waitpid(worker.pid, nullptr, 0) < 0 && errno == EINTR);
+        }
+        if (worker.has_token)
+            jobserver_release(worker.token);
+    }
+
+    return !aborted && done == programs.size();
+}
+
+#endif
+
+bool supershader::compile_batch(const std::vector<args_t>& programs, const args_t& args){
+    std::vector<char> results(programs.size(), 0);
+    std::vector<double> times(programs.size(), 0.0);
+
+    // Up to date programs succeed without being sent to workers
+    std::vector<args_t> outdated;
+    std::vector<size_t> outdatedindex;
+    if (args.skip_up_to_date){
+        process_reference_t process;
+
+        std::vector<char> uptodate(programs.size(), 0);
+        run_parallel(uptodate, args.jobs, [&](size_t i){
+            return is_up_to_date(programs[i]);
+        });
+        for (size_t i = 0; i < programs.size(); i++){
+            if (uptodate[i]){
+                results[i] = 1;
+            }else{
+                outdated.push_back(programs[i]);
+                outdatedindex.push_back(i);
+            }
+        }
+        fprintf(stdout, "%i of %i programs up to date\n", (int)(programs.size() - outdated.size()), (int)programs.size());
+    }else{
+        outdated = programs;
+        for (size_t i = 0; i < programs.size(); i++){
+            outdatedindex.push_back(i);
+        }
+    }
+
+    std::vector<char> outdatedresults(outdated.size(), 0);
+    std::vector<double> outdatedtimes(outdated.size(), 0.0);
+
+    bool isolated = false;
+    bool finished = true;
+    if (args.isolate){
+#ifndef _WIN32
+        if (!compile_batch_isolated(outdated, args.jobs, outdatedresults, outdatedtimes)){
+            print_error("Isolated workers stopped before all programs were compiled\n");
+            finished = false;
+        }
+        isolated = true;
+#else
+        fprintf(stderr, "Isolated workers are not supported on Windows, using threads\n");
+#endif
+    }
+
+    if (!isolated){
+        process_reference_t process;
+
+        run_parallel(outdatedresults, args.jobs, [&](size_t i){
+            auto start = std::chrono::steady_clock::now();
+            bool success = compile_program(outdated[i]);
+            outdatedtimes[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            return success;
+        });
+    }
+
+    for (size_t i = 0; i < outdated.size(); i++){
+        results[outdatedindex[i]] = outdatedresults[i];
+        times[outdatedindex[i]] = outdatedtimes[i];
+    }
+
+    bool success = print_batch_summary(programs, results) && finished;
+
+    if (!args.index_file.empty()){
+        if (!write_batch_index(programs, results, times, args))
+            return false;
+    }
+
+    return success;
+}
@@ -0,0 +1,381 @@
+//
+// (c) 2024 Eduardo Doria.
+//
+
+#include "supershader.h"
+
+#include "nlohmann/json.hpp"
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#ifndef SUPERSHADER_VERSION
+#define SUPERSHADER_VERSION ""
+#endif
+
+#ifndef ENABLE_OPT
+#define ENABLE_OPT 0
+#endif
+
+using namespace supershader;
+
+using json = nlohmann::ordered_json;
+
+// Increase when cached data or key changes
+static const char* CacheFormat = "supershader-cache-4";
+
+// Builds without a version do not share entries with other builds
+static std::string get_build_version(){
+    std::string version = std::string(SUPERSHADER_VERSION);
+    if (version.empty())
+        version = std::string("dev ") + __DATE__ + " " + __TIME__;
+    return version;
+}
+
+// Strings are length prefixed by sha256_update, lists are prefixed by their count
+static void hash_defines(sha256_t& ctx, const std::vector<std::string>& defines){
+    sha256_update(ctx, std::to_string(defines.size()));
+    for (const std::string& def : defines){
+        sha256_update(ctx, def);
+    }
+}
+
+static std::vector<std::string> get_spec_strings(const args_t& args){
+    std::vector<std::string> specs;
+    for (const define_t& sc : args.spec_constants){
+        specs.push_back(sc.def + "=" + sc.value);
+    }
+    return specs;
+}
+
+// Size of cache is not known until first store, then it is estimated
+static std::mutex cache_size_mutex;
+static std::map<std::string, int64_t> cache_sizes;
+
+static std::atomic<uint64_t> program_hits(0);
+static std::atomic<uint64_t> program_misses(0);
+static std::atomic<uint64_t> stage_hits(0);
+static std::atomic<uint64_t> stage_misses(0);
+static std::atomic<uint64_t> evictions(0);
+
+static std::string get_cache_path(const args_t& args, const std::string& key, const std::string& extension){
+    return args.cache_dir + "/" + key.substr(0, 2) + "/" + key + extension;
+}
+
+static bool is_cache_entry(const std::filesystem::path& path){
+    std::string extension = path.extension().string();
+    return extension == ".result" || extension == ".spv";
+}
+
+static bool is_temp_file(const std::filesystem::path& path){
+    return path.filename().string().find(".tmp.") != std::string::npos;
+}
+
+static bool read_file(std::string& content, const std::string& path){
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs)
+        return false;
+
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    content = ss.str();
+
+    // Modification time is last use, least recently used entries are evicted first
+    std::error_code ec;
+    std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+
+    return true;
+}
+
+static int64_t get_cache_size(const args_t& args){
+    namespace fs = std::filesystem;
+    std::error_code ec;
+
+    int64_t size = 0;
+    for (fs::recursive_directory_iterator it(args.cache_dir, ec), end; !ec && it != end; it.increment(ec)){
+        if (it->is_regular_file(ec) && is_cache_entry(it->path()))
+            size += (int64_t)it->file_size(ec);
+    }
+
+    return size;
+}
+
+// Oldest entries are removed until cache is below 90% of max size
+static int64_t evict_cache(const args_t& args){
+    namespace fs = std::filesystem;
+    std::error_code ec;
+
+    struct entry_t{
+        fs::path path;
+        fs::file_time_type time;
+        int64_t size;
+    };
+
+    std::vector<entry_t> entries;
+    int64_t size = 0;
+    auto now = fs::file_time_type::clock::now();
+    for (fs::recursive_directory_iterator it(args.cache_dir, ec), end; !ec && it != end; it.increment(ec)){
+        if (!it->is_regular_file(ec))
+            continue;
+
+        fs::file_time_type time = it->last_write_time(ec);
+        if (is_temp_file(it->path())){
+            // Left by a process that did not finish its write
+            if (!ec && now - time > std::chrono::hours(1))
+                fs::remove(it->path(), ec);
+            continue;
+        }
+        if (!is_cache_entry(it->path()))
+            continue;
+
+        entry_t entry = {it->path(), time, (int64_t)it->file_size(ec)};
+        entries.push_back(entry);
+        size += entry.size;
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const entry_t& a, const entry_t& b){
+        return a.time < b.time;
+    });
+
+    int64_t target = args.cache_max_size / 10 * 9;
+    for (const entry_t& entry : entries){
+        if (size <= target)
+            break;
+        // Other process can remove it first
+        if (fs::remove(entry.path, ec))
+            evictions++;
+        size -= entry.size;
+    }
+
+    return size;
+}
+
+static void add_cache_size(int64_t bytes, const args_t& args){
+    if (args.cache_max_size <= 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(cache_size_mutex);
+
+    auto it = cache_sizes.find(args.cache_dir);
+    if (it == cache_sizes.end())
+        it = cache_sizes.insert({args.cache_dir, get_cache_size(args)}).first;
+    else
+        it->second += bytes;
+
+    // Other processes also write, real size is found again when evicting
+    if (it->second > args.cache_max_size)
+        it->second = evict_cache(args);
+}
+
+// Other processes never read a partial entry
+static bool write_file(const std::string& content, const std::string& path, const args_t& args){
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+
+    if (!write_output_file(path, content))
+        return false;
+
+    add_cache_size((int64_t)content.size(), args);
+
+    return true;
+}
+
+// Preprocessed sources of each distinct lang preamble, comments and formatting do not change the key
+std::string supershader::get_program_cache_key(preamble_preprocessed_t& preprocessed, const std::vector<input_t>& inputs, const std::vector<std::set<std::string>>& macros, const args_t& args){
+    sha256_t ctx;
+    sha256_init(ctx);
+
+    sha256_update(ctx, std::string(CacheFormat));
+    sha256_update(ctx, get_build_version());
+    sha256_update(ctx, std::to_string(ENABLE_OPT));
+
+    std::vector<target_t> targets = get_targets(args);
+    sha256_update(ctx, std::to_string(targets.size()));
+    for (const target_t& target : targets){
+        sha256_update(ctx, target.name);
+        sha256_update(ctx, std::to_string(target.lang) + "," + std::to_string(target.version) + "," + std::to_string(target.es) + "," + std::to_string(target.platform));
+    }
+
+    hash_defines(ctx, get_spec_strings(args));
+
+    std::set<std::string> preambles;
+    for (const args_t& targetargs : get_target_args(args)){
+        sha256_update(ctx, get_optimization_key(targetargs));
+
+        std::string preamble = get_lang_preamble(targetargs);
+        bool first = preambles.insert(preamble).second;
+        sha256_update(ctx, first ? "1" : "0");
+        if (!first)
+            continue;
+
+        // Not cached if source has errors, compile reports them
+        preprocessed_t& stages = preprocessed[preamble];
+        if (!preprocess_normalized(stages.sources, stages.included_files, inputs, targetargs)){
+            preprocessed.erase(preamble);
+            return "";
+        }
+        const std::vector<std::string>& sources = stages.sources;
+
+        // Only referenced defines, they are part of reflection
+        sha256_update(ctx, preamble);
+        for (size_t i = 0; i < inputs.size(); i++){
+            sha256_update(ctx, std::to_string(inputs[i].stage_type));
+            sha256_update(ctx, sources[i]);
+            std::vector<std::string> defines;
+            for (const define_t& def : targetargs.defines){
+                if (macros[i].find(def.def) != macros[i].end())
+                    defines.push_back(def.def + "=" + def.value);
+            }
+            hash_defines(ctx, defines);
+        }
+    }
+
+    return sha256_final(ctx);
+}
+
+static bool read_cached_program(std::vector<target_result_t>& results, const std::string& key, const std::vector<input_t>& inputs, const args_t& args){
+    std::string result_data;
+    if (!read_file(result_data, get_cache_path(args, key, ".result")))
+        return false;
+
+    json result = json::parse(result_data, nullptr, false);
+    std::vector<target_t> targets = get_targets(args);
+    if (result.is_discarded() || !result.is_array() || result.size() != targets.size())
+        return false;
+
+    std::vector<args_t> targetargs = get_target_args(args);
+
+    std::vector<target_result_t> cached(targets.size());
+    for (size_t t = 0; t < targets.size(); t++){
+        std::vector<input_t> cachedinputs;
+
+        cached[t].target = targets[t];
+        cached[t].inputs = inputs;
+        cached[t].json = result[t].dump();
+        if (!parse_json_buffer(cached[t].spirvcrossvec, cachedinputs, cached[t].json))
+            return false;
+        if (!generate_sbs_buffer(cached[t].sbs, cached[t].spirvcrossvec, inputs, targetargs[t]))
+            return false;
+    }
+
+    results = cached;
+
+    return true;
+}
+
+// Missing and corrupt entries are both misses
+bool supershader::load_cached_program(std::vector<target_result_t>& results, const std::string& key, const std::vector<input_t>& inputs, const args_t& args){
+    if (!read_cached_program(results, key, inputs, args)){
+        program_misses++;
+        return false;
+    }
+    program_hits++;
+
+    return true;
+}
+
+bool supershader::store_cached_program(const std::vector<target_result_t>& results, const std::string& key, const args_t& args){
+    json result = json::array();
+    for (const target_result_t& target : results){
+        result.push_back(json::parse(target.json));
+    }
+
+    return write_file(result.dump(), get_cache_path(args, key, ".result"), args);
+}
+
+// All stages are linked together, their sources and options are all that SPIR-V depends on,
+// so key is known before parsing and a hit skips glslang
+std::string supershader::get_spirv_cache_key(const std::vector<input_t>& inputs, const std::vector<std::string>& normalized, const args_t& args){
+    sha256_t ctx;
+    sha256_init(ctx);
+
+    sha256_update(ctx, std::string(CacheFormat) + "-spirv");
+    sha256_update(ctx, get_build_version());
+    sha256_update(ctx, std::to_string(ENABLE_OPT));
+
+    sha256_update(ctx, get_lang_preamble(args));
+    sha256_update(ctx, get_optimization_key(args));
+    hash_defines(ctx, get_spec_strings(args));
+
+    sha256_update(ctx, std::to_string(inputs.size()));
+    for (size_t i = 0; i < inputs.size() && i < normalized.size(); i++){
+        sha256_update(ctx, std::to_string(inputs[i].stage_type));
+        sha256_update(ctx, normalized[i]);
+    }
+
+    return sha256_final(ctx);
+}
+
+static std::string get_stage_path(const args_t& args, const std::string& key, size_t stage){
+    return get_cache_path(args, key, "-" + std::to_string(stage) + ".spv");
+}
+
+bool supershader::load_cached_spirv(std::vector<spirv_t>& spirvvec, const std::string& key, const args_t& args){
+    // Stages are only used together
+    std::vector<spirv_t> cached(spirvvec.size());
+    for (size_t i = 0; i < cached.size(); i++){
+        std::string data;
+        if (!read_file(data, get_stage_path(args, key, i)) || data.empty() || data.size() % sizeof(uint32_t) != 0){
+            stage_misses += cached.size();
+            return false;
+        }
+
+        cached[i].bytecode.resize(data.size() / sizeof(uint32_t));
+        memcpy(cached[i].bytecode.data(), data.data(), data.size());
+    }
+
+    spirvvec = cached;
+    stage_hits += cached.size();
+
+    return true;
+}
+
+bool supershader::store_cached_spirv(const std::vector<spirv_t>& spirvvec, const std::string& key, const args_t& args){
+    bool success = true;
+    for (size_t i = 0; i < spirvvec.size(); i++){
+        std::string data((const char*)spirvvec[i].bytecode.data(), spirvvec[i].bytecode.size() * sizeof(uint32_t));
+        if (!write_file(data, get_stage_path(args, key, i), args))
+            success = false;
+    }
+
+    return success;
+}
+
+cache_stats_t supershader::get_cache_stats(){
+    cache_stats_t stats;
+    stats.program_hits = program_hits;
+    stats.program_misses = program_misses;
+    stats.stage_hits = stage_hits;
+    stats.stage_misses = stage_misses;
+    stats.evictions = evictions;
+
+    return stats;
+}
+
+void supershader::add_cache_stats(const cache_stats_t& stats){
+    program_hits += stats.program_hits;
+    program_misses += stats.program_misses;
+    stage_hits += stats.stage_hits;
+    stage_misses += stats.stage_misses;
+    evictions += stats.evictions;
+}
+
+void supershader::print_cache_stats(const args_t& args){
+    cache_stats_t stats = get_cache_stats();
+
+    fprintf(stdout, "Cache %s:\n", args.cache_dir.c_str());
+    fprintf(stdout, "  programs: %llu hits, %llu misses\n", (unsigned long long)stats.program_hits, (unsigned long long)stats.program_misses);
+    fprintf(stdout, "  stages: %llu hits, %llu misses\n", (unsigned long long)stats.stage_hits, (unsigned long long)stats.stage_misses);
+    fprintf(stdout, "  evictions: %llu\n", (unsigned long long)stats.evictions);
+    if (args.cache_max_size > 0){
+        fprintf(stdout, "  size: %lld of %lld bytes\n", (long long)get_cache_size(args), (long long)args.cache_max_size);
+    }else{
+        fprintf(stdout, "  size: %lld bytes\n", (long long)get_cache_size(args));
+    }
+}
@@ -0,0 +1,42 @@
+//
+// (c) 2024 Eduardo Doria.
+//
+
+#include "supershader.h"
+
+using namespace supershader;
+
+Compiler::Compiler(){
+    initialize_process();
+}
+
+Compiler::~Compiler(){
+    finalize_process();
+}
+
+compile_result_t Compiler::compile(const args_t& request){
+    compile_result_t result;
+
+    // Messages of this compile go to result diagnostics
+    std::string* previous = get_output_capture();
+    set_output_capture(&result.diagnostics);
+    try{
+        result.success = compile_program_results(result.targets, result.included_files, request);
+    }catch (const std::exception& e){
+        print_error("%s\n", e.what());
+        result.success = false;
+    }
+    set_output_capture(previous);
+
+    if (!result.success)
+        result.targets.clear();
+
+    return result;
+}
+
+bool Compiler::write(const compile_result_t& result, const args_t& request){
+    if (!result.success)
+        return false;
+
+    return write_program_results(result.targets, result.included_files, request);
+}
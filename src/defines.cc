@@ -0,0 +1,175 @@
+//
+// (c) 2024 Eduardo Doria.
+//
+
+#include "supershader.h"
+
+#include <sstream>
+#include <cctype>
+
+using namespace supershader;
+
+static bool is_identifier_start(char c){
+    return std::isalpha((unsigned char)c) || c == '_';
+}
+
+static bool is_identifier_char(char c){
+    return std::isalnum((unsigned char)c) || c == '_';
+}
+
+static void add_identifiers(std::set<std::string>& identifiers, const std::string& text){
+    size_t i = 0;
+    while (i < text.size()){
+        if (is_identifier_start(text[i])){
+            size_t start = i;
+            while (i < text.size() && is_identifier_char(text[i]))
+                i++;
+            identifiers.insert(text.substr(start, i - start));
+        }else if (std::isdigit((unsigned char)text[i])){
+            // Numbers like 1.0e5 or 0x1F are not identifiers
+            while (i < text.size() && (is_identifier_char(text[i]) || text[i] == '.'))
+                i++;
+        }else{
+            i++;
+        }
+    }
+}
+
+// Comments are removed and continued lines joined, line count is not kept
+static std::vector<std::string> get_logical_lines(const std::string& source){
+    std::string text;
+    for (size_t i = 0; i < source.size(); i++){
+        if (source[i] == '/' && i + 1 < source.size() && source[i + 1] == '/'){
+            while (i < source.size() && source[i] != '\n')
+                i++;
+            text += '\n';
+        }else if (source[i] == '/' && i + 1 < source.size() && source[i + 1] == '*'){
+            i += 2;
+            while (i + 1 < source.size() && !(source[i] == '*' && source[i + 1] == '/'))
+                i++;
+            i++;
+            text += ' ';
+        }else if (source[i] == '\\' && i + 1 < source.size() && source[i + 1] == '\n'){
+            i++;
+        }else{
+            text += source[i];
+        }
+    }
+
+    std::vector<std::string> lines;
+    std::stringstream ss(text);
+    std::string line;
+    while (std::getline(ss, line)){
+        lines.push_back(line);
+    }
+
+    return lines;
+}
+
+static std::string get_directory(const std::string& path){
+    size_t last = path.find_last_of("/\\");
+    return last == std::string::npos ? "." : path.substr(0, last);
+}
+
+struct scan_state_t{
+    std::set<std::string> macros;
+    std::set<std::string> included;
+    std::set<std::string> missing;
+    include_resolver_t resolver;
+};
+
+// Same lookup of compile includer
+static bool read_include(std::string& content, std::string& path, scan_state_t& state, const std::string& name, const std::string& stage_file, const args_t& args){
+    if (args.useBuffers){
+        auto it = args.fileBuffers.find(name);
+        if (it == args.fileBuffers.end())
+            return false;
+        path = name;
+        content = it->second;
+        return true;
+    }
+
+    if (!resolve_include(path, state.resolver, get_directory(stage_file), name))
+        return false;
+
+    std::shared_ptr<const file_content_t> file = get_cached_file(path);
+    if (!file)
+        return false;
+    content.assign(file->data, file->size);
+
+    return true;
+}
+
+static void scan_source(scan_state_t& state, const std::string& source, const std::string& stage_file, const args_t& args){
+    for (const std::string& line : get_logical_lines(source)){
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos)
+            continue;
+
+        if (line[start] != '#'){
+            add_identifiers(state.macros, line);
+            continue;
+        }
+
+        size_t dstart = line.find_first_not_of(" \t", start + 1);
+        if (dstart == std::string::npos)
+            continue;
+        size_t dend = dstart;
+        while (dend < line.size() && is_identifier_char(line[dend]))
+            dend++;
+        std::string directive = line.substr(dstart, dend - dstart);
+        std::string rest = line.substr(dend);
+
+        if (directive == "if" || directive == "ifdef" || directive == "ifndef" || directive == "elif" || directive == "define"){
+            add_identifiers(state.macros, rest);
+        }else if (directive == "include"){
+            // Includes of all branches, a define can enable an include. Only "file", <file> is not searched by compile.
+            size_t open = rest.find('"');
+            if (open == std::string::npos)
+                continue;
+            size_t close = rest.find('"', open + 1);
+            if (close == std::string::npos)
+                continue;
+
+            std::string name = rest.substr(open + 1, close - open - 1);
+            std::string content;
+            std::string path;
+            if (!read_include(content, path, state, name, stage_file, args)){
+                state.missing.insert(name);
+            }else if (state.included.insert(path).second){
+                scan_source(state, content, stage_file, args);
+            }
+        }
+    }
+}
+
+void supershader::get_stage_macros(std::vector<std::set<std::string>>& macros, const std::vector<input_t>& inputs, const args_t& args){
+    macros.assign(inputs.size(), std::set<std::string>());
+
+    for (size_t i = 0; i < inputs.size(); i++){
+        scan_state_t state;
+        state.resolver.directories = args.include_dirs;
+        scan_source(state, inputs[i].source, inputs[i].filename, args);
+        macros[i] = state.macros;
+    }
+}
+
+void supershader::get_all_includes(std::set<std::string>& included_files, std::set<std::string>& missing_files, const std::vector<input_t>& inputs, const args_t& args){
+    for (const input_t& input : inputs){
+        scan_state_t state;
+        state.resolver.directories = args.include_dirs;
+        scan_source(state, input.source, input.filename, args);
+        included_files.insert(state.included.begin(), state.included.end());
+        missing_files.insert(state.missing.begin(), state.missing.end());
+    }
+}
+
+std::vector<std::string> supershader::get_used_defines(const std::vector<std::string>& defines, const std::set<std::string>& macros){
+    std::vector<std::string> used;
+    for (const std::string& def : defines){
+        if (macros.find(def) != macros.end())
+            used.push_back(def);
+    }
+
+    return used;
+}
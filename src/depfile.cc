@@ -0,0 +1,286 @@
+//
+// (c) 2024 Eduardo Doria.
+//
+
+#include "supershader.h"
+
+#include "nlohmann/json.hpp"
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <algorithm>
+#include <cctype>
+
+using namespace supershader;
+
+using json = nlohmann::ordered_json;
+
+static const char* ScanExtensions[] = {".vert", ".frag", ".glsl", ".vs", ".fs"};
+
+// Make and Ninja read the same escapes
+static std::string escape_path(const std::string& path){
+    std::string escaped;
+    for (char c : path){
+        if (c == ' ' || c == '#')
+            escaped += '\\';
+        else if (c == '$')
+            escaped += '$';
+        escaped += c;
+    }
+    return escaped;
+}
+
+static bool read_depfile(std::vector<std::string>& files, const std::string& path){
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs)
+        return false;
+
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    std::string content = ss.str();
+
+    // Dependencies are after the first ':' followed by a space
+    bool deps = false;
+    std::string file;
+    for (size_t i = 0; i < content.size(); i++){
+        char c = content[i];
+        char next = (i + 1 < content.size()) ? content[i + 1] : '\0';
+
+        if (c == '\\' && (next == ' ' || next == '#')){
+            file += next;
+            i++;
+        }else if (c == '$' && next == '$'){
+            file += next;
+            i++;
+        }else if (c == ':' && !deps && (next == '\0' || std::isspace((unsigned char)next))){
+            deps = true;
+            file.clear();
+        }else if (std::isspace((unsigned char)c) || (c == '\\' && (next == '\n' || next == '\r'))){
+            if (deps && !file.empty())
+                files.push_back(file);
+            file.clear();
+        }else{
+            file += c;
+        }
+    }
+    if (deps && !file.empty())
+        files.push_back(file);
+
+    return deps;
+}
+
+// Files that are not included by sources
+static void add_program_files(std::set<std::string>& files, const args_t& args){
+    if (!args.vert_file.empty())
+        files.insert(args.vert_file);
+    if (!args.frag_file.empty())
+        files.insert(args.frag_file);
+
+    // Programs of a manifest change with it
+    if (!args.manifest_file.empty())
+        files.insert(args.manifest_file);
+
+    if (!args.pass_recipe.empty())
+        files.insert(args.pass_recipe);
+}
+
+bool supershader::get_dependencies(std::set<std::string>& files, const args_t& args){
+    process_reference_t process;
+
+    std::vector<input_t> inputs;
+    if (!load_input(inputs, args))
+        return false;
+
+    add_program_files(files, args);
+
+    if (!args.variants.empty()){
+        // A variant define can enable an include
+        std::set<std::string> missing;
+        get_all_includes(files, missing, inputs, args);
+        return true;
+    }
+
+    std::set<std::string> preambles;
+    for (const args_t& targetargs : get_target_args(args)){
+        if (!preambles.insert(get_lang_preamble(targetargs)).second)
+            continue;
+
+        std::vector<std::string> sources;
+        if (!preprocess_normalized(sources, files, inputs, targetargs))
+            return false;
+    }
+
+    return true;
+}
+
+bool supershader::write_depfile(const args_t& args, const std::set<std::string>& included_files){
+    if (args.depfile.empty())
+        return true;
+
+    // Files opened by the compile, not preprocessed again
+    std::set<std::string> files = included_files;
+    add_program_files(files, args);
+
+    std::string content;
+    std::vector<std::string> outputs = get_output_files(args);
+    for (size_t i = 0; i < outputs.size(); i++){
+        content += (i > 0 ? " " : "") + escape_path(outputs[i]);
+    }
+    content += ":";
+    for (const std::string& file : files){
+        content += " \\\n  " + escape_path(file);
+    }
+    content += "\n";
+
+    // A partial depfile would list fewer dependencies and make outputs look up to date
+    if (!write_output_file(args.depfile, content)) {
+        print_error("Writing to file %s failed\n", args.depfile.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool supershader::is_up_to_date(const args_t& args){
+    namespace fs = std::filesystem;
+    std::error_code ec;
+
+    // Dependencies change only if one of previous dependencies changed
+    std::vector<std::string> deps;
+    if (!args.depfile.empty()){
+        if (!read_depfile(deps, args.depfile))
+            return false;
+    }else{
+        std::set<std::string> files;
+        if (!get_dependencies(files, args))
+            return false;
+        deps.assign(files.begin(), files.end());
+    }
+
+    fs::file_time_type oldest_output = fs::file_time_type::max();
+    for (const std::string& output : get_output_files(args)){
+        fs::file_time_type time = fs::last_write_time(output, ec);
+        if (ec)
+            return false;
+        oldest_output = std::min(oldest_output, time);
+    }
+
+    for (const std::string& dep : deps){
+        fs::file_time_type time = fs::last_write_time(dep, ec);
+        if (ec || time > oldest_output)
+            return false;
+    }
+
+    return true;
+}
+
+static json scan_inputs(const std::vector<input_t>& inputs, const args_t& args){
+    std::set<std::string> includes;
+    std::set<std::string> missing;
+    get_all_includes(includes, missing, inputs, args);
+
+    json j;
+    j["includes"] = includes;
+    if (!missing.empty())
+        j["missing"] = missing;
+
+    return j;
+}
+
+// Stage from extension, as in --autotune, included .glsl files have no stage of their own
+static stage_type_t get_scan_stage(const std::string& path){
+    std::string extension = std::filesystem::path(path).extension().string();
+    if (extension == ".frag" || extension == ".fs")
+        return STAGE_FRAGMENT;
+    return STAGE_VERTEX;
+}
+
+static bool scan_directory(json& files, const args_t& args){
+    namespace fs = std::filesystem;
+    std::error_code ec;
+
+    std::vector<std::string> paths;
+    for (fs::recursive_directory_iterator it(args.scan_dir, ec), end; !ec && it != end; it.increment(ec)){
+        if (!it->is_regular_file())
+            continue;
+        std::string extension = it->path().extension().string();
+        for (const char* scan_extension : ScanExtensions){
+            if (extension == scan_extension){
+                paths.push_back(it->path().generic_string());
+                break;
+            }
+        }
+    }
+    if (ec){
+        print_error("Unable to scan directory %s: %s\n", args.scan_dir.c_str(), ec.message().c_str());
+        return false;
+    }
+    std::sort(paths.begin(), paths.end());
+
+    // Each file is scanned as a stage, its directory is the first include lookup
+    std::vector<json> entries(paths.size());
+    std::vector<char> results(paths.size(), 0);
+    bool success = run_parallel(results, args.jobs, [&](size_t i){
+        std::ifstream ifs(paths[i], std::ios::binary);
+        if (!ifs){
+            print_error("Unable to open file: %s\n", paths[i].c_str());
+            return false;
+        }
+        std::stringstream ss;
+        ss << ifs.rdbuf();
+
+        input_t input;
+        input.stage_type = get_scan_stage(paths[i]);
+        input.filename = paths[i];
+        input.source = ss.str();
+
+        entries[i]["file"] = paths[i];
+        entries[i].update(scan_inputs({input}, args));
+        return true;
+    });
+
+    files = entries;
+
+    return success;
+}
+
+bool supershader::scan_dependencies(const std::vector<args_t>& programs, const args_t& args){
+    json j;
+    bool success = true;
+
+    if (!args.scan_dir.empty()){
+        json files;
+        success = scan_directory(files, args);
+        j["files"] = files;
+    }else{
+        std::vector<json> entries(programs.size());
+        std::vector<char> results(programs.size(), 0);
+        success = run_parallel(results, args.jobs, [&](size_t i){
+            const args_t& program = programs[i];
+            entries[i]["name"] = program.program_name.empty() ? program.output_basename : program.program_name;
+
+            std::vector<input_t> inputs;
+            if (!load_input(inputs, program))
+                return false;
+
+            std::vector<std::string> files;
+            for (const input_t& input : inputs){
+                files.push_back(input.filename);
+            }
+            entries[i]["inputs"] = files;
+            entries[i].update(scan_inputs(inputs, program));
+            entries[i]["outputs"] = get_output_files(program);
+            return true;
+        });
+        j["programs"] = entries;
+    }
+
+    if (args.scan_deps == "-"){
+        fprintf(stdout, "%s\n", j.dump(4).c_str());
+    }else if (!write_output_file(args.scan_deps, j.dump(4) + "\n")) {
+        print_error("Writing to file %s failed\n", args.scan_deps.c_str());
+        return false;
+    }
+
+    return success;
+}
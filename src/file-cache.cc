@@ -0,0 +1,358 @@
+//
+// (c) 2024 Eduardo Doria.
+//
+
+#include "supershader.h"
+
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <atomic>
+#include <cerrno>
+
+using namespace supershader;
+
+struct file_stamp_t{
+    int64_t mtime = 0;
+    int64_t size = -1;
+
+    bool operator==(const file_stamp_t& other) const{
+        return mtime == other.mtime && size == other.size;
+    }
+};
+
+struct cached_entry_t{
+    file_stamp_t stamp;
+    std::shared_ptr<const file_content_t> content;
+    uint64_t last_use = 0;
+};
+
+// Long running watch and server keep only recently used files
+static const size_t MaxCachedFiles = 4096;
+static const size_t MaxCachedBytes = 256 * 1024 * 1024;
+
+static std::mutex file_cache_mutex;
+static std::unordered_map<std::string, std::string> canonical_paths;
+static std::unordered_map<std::string, cached_entry_t> file_cache;
+static size_t file_cache_bytes = 0;
+static uint64_t file_cache_uses = 0;
+
+#ifndef _WIN32
+
+file_content_t::~file_content_t(){
+    if (mapping)
+        munmap(mapping, size);
+}
+
+// Smaller files are copied, a mapping gives SIGBUS if file is truncated while it is read
+static const int64_t MinMappedSize = 1024 * 1024;
+
+static void get_stat_stamp(file_stamp_t& stamp, const struct stat& st){
+#ifdef __APPLE__
+    stamp.mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    stamp.mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    stamp.size = (int64_t)st.st_size;
+}
+
+static bool get_file_stamp(file_stamp_t& stamp, const std::string& path){
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        return false;
+
+    get_stat_stamp(stamp, st);
+
+    return true;
+}
+
+static void read_fd_content(file_content_t& content, int fd, size_t size){
+    content.buffer.resize(size);
+    size_t done = 0;
+    while (done < size){
+        ssize_t n = read(fd, &content.buffer[done], size - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += (size_t)n;
+    }
+    // Truncated while reading
+    content.buffer.resize(done);
+    content.data = content.buffer.data();
+    content.size = content.buffer.size();
+}
+
+// Stamp is taken from opened file, so it matches the content that is read
+static std::shared_ptr<file_content_t> read_file_content(const std::string& path, file_stamp_t& stamp){
+    std::shared_ptr<file_content_t> content = std::make_shared<file_content_t>();
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)){
+        close(fd);
+        return nullptr;
+    }
+    get_stat_stamp(stamp, st);
+
+    if (stamp.size < MinMappedSize){
+        read_fd_content(*content, fd, (size_t)stamp.size);
+        close(fd);
+        return content;
+    }
+
+    void* mapping = mmap(nullptr, (size_t)stamp.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED){
+        close(fd);
+        return nullptr;
+    }
+
+    // File changed while it was mapped
+    file_stamp_t mapped;
+    if (fstat(fd, &st) == 0)
+        get_stat_stamp(mapped, st);
+    close(fd);
+    if (!(mapped == stamp)){
+        munmap(mapping, (size_t)stamp.size);
+        return nullptr;
+    }
+
+    content->mapping = mapping;
+    content->data = (const char*)mapping;
+    content->size = (size_t)stamp.size;
+
+    return content;
+}
+
+#else
+
+file_content_t::~file_content_t(){
+}
+
+static bool get_file_stamp(file_stamp_t& stamp, const std::string& path){
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(path, ec))
+        return false;
+
+    stamp.mtime = (int64_t)std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+    stamp.size = (int64_t)std::filesystem::file_size(path, ec);
+
+    return !ec;
+}
+
+static std::shared_ptr<file_content_t> read_file_content(const std::string& path, file_stamp_t& stamp){
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs)
+        return nullptr;
+
+    std::shared_ptr<file_content_t> content = std::make_shared<file_content_t>();
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    content->buffer = ss.str();
+    content->data = content->buffer.data();
+    content->size = content->buffer.size();
+
+    return content;
+}
+
+#endif
+
+// Same file by other relative paths shares the entry
+static std::string get_canonical_path(const std::string& path){
+    auto it = canonical_paths.find(path);
+    if (it != canonical_paths.end())
+        return it->second;
+
+    std::error_code ec;
+    std::string canonical = std::filesystem::weakly_canonical(path, ec).string();
+    if (ec)
+        canonical = path;
+
+    if (canonical_paths.size() >= MaxCachedFiles)
+        canonical_paths.clear();
+    canonical_paths[path] = canonical;
+
+    return canonical;
+}
+
+// Least recently used entries are removed, views of them stay valid for their users
+static void evict_cached_files(){
+    while (file_cache.size() > MaxCachedFiles || (file_cache_bytes > MaxCachedBytes && file_cache.size() > 1)){
+        auto oldest = file_cache.begin();
+        for (auto it = file_cache.begin(); it != file_cache.end(); ++it){
+            if (it->second.last_use < oldest->second.last_use)
+                oldest = it;
+        }
+        file_cache_bytes -= oldest->second.content ? oldest->second.content->size : 0;
+        file_cache.erase(oldest);
+    }
+}
+
+std::shared_ptr<const file_content_t> supershader::get_cached_file(const std::string& path){
+    file_stamp_t stamp;
+    if (!get_file_stamp(stamp, path))
+        return nullptr;
+
+    std::lock_guard<std::mutex> lock(file_cache_mutex);
+
+    cached_entry_t& entry = file_cache[get_canonical_path(path)];
+    entry.last_use = ++file_cache_uses;
+    if (entry.content && entry.stamp == stamp)
+        return entry.content;
+
+    // Views of old content stay valid until their last user releases them
+    std::shared_ptr<file_content_t> content = read_file_content(path, stamp);
+    if (!content){
+        if (!entry.content)
+            file_cache.erase(get_canonical_path(path));
+        return nullptr;
+    }
+
+    file_cache_bytes -= entry.content ? entry.content->size : 0;
+    file_cache_bytes += content->size;
+    entry.stamp = stamp;
+    entry.content = content;
+
+    evict_cached_files();
+
+    return content;
+}
+
+struct directory_index_t{
+    std::filesystem::file_time_type mtime;
+    std::unordered_set<std::string> files;
+};
+
+static std::mutex directory_index_mutex;
+static std::unordered_map<std::string, directory_index_t> directory_indices;
+
+static bool directory_has_file(include_resolver_t& resolver, const std::string& directory, const std::string& file){
+    namespace fs = std::filesystem;
+    std::error_code ec;
+
+    // Directory is checked for changes once by each resolver
+    bool validate = resolver.validated.insert(directory).second;
+    fs::file_time_type mtime;
+    if (validate){
+        mtime = fs::last_write_time(directory, ec);
+        if (ec)
+            return false;
+    }
+
+    std::lock_guard<std::mutex> lock(directory_index_mutex);
+
+    auto it = directory_indices.find(directory);
+    if (it == directory_indices.end() || (validate && it->second.mtime != mtime)){
+        if (!validate){
+            mtime = fs::last_write_time(directory, ec);
+            if (ec)
+                return false;
+        }
+
+        directory_index_t index;
+        index.mtime = mtime;
+        for (fs::directory_iterator dit(directory, ec), end; !ec && dit != end; dit.increment(ec)){
+            if (!dit->is_directory(ec))
+                index.files.insert(dit->path().filename().string());
+        }
+        if (ec)
+            return false;
+
+        it = directory_indices.insert_or_assign(directory, std::move(index)).first;
+    }
+
+    return it->second.files.find(file) != it->second.files.end();
+}
+
+static std::string get_parent_directory(const std::string& path, std::string& file){
+    size_t last = path.find_last_of('/');
+    if (last == std::string::npos){
+        file = path;
+        return ".";
+    }
+    file = path.substr(last + 1);
+    return last == 0 ? "/" : path.substr(0, last);
+}
+
+bool supershader::resolve_include(std::string& path, include_resolver_t& resolver, const std::string& stage_directory, const std::string& name){
+    std::string key = stage_directory + '\n' + name;
+    auto it = resolver.resolved.find(key);
+    if (it != resolver.resolved.end()){
+        path = it->second;
+        return !path.empty();
+    }
+
+    path = "";
+
+    std::vector<std::string> directories = {stage_directory};
+    directories.insert(directories.end(), resolver.directories.begin(), resolver.directories.end());
+    for (const std::string& directory : directories){
+        std::string candidate = directory + '/' + name;
+        std::replace(candidate.begin(), candidate.end(), '\\', '/');
+
+        std::string file;
+        std::string parent = get_parent_directory(candidate, file);
+        if (directory_has_file(resolver, parent, file)){
+            path = candidate;
+            break;
+        }
+    }
+
+    // Not found is remembered too
+    resolver.resolved[key] = path;
+
+    return !path.empty();
+}
+
+int supershader::get_process_id(){
+#ifdef _WIN32
+    return _getpid();
+#else
+    return (int)getpid();
+#endif
+}
+
+// Written to a temporary file and renamed, readers see old or new file, never a partial one
+bool supershader::write_output_file(const std::string& path, const std::string& content){
+    namespace fs = std::filesystem;
+    std::error_code ec;
+
+    static std::atomic<uint64_t> temp_counter(0);
+    std::string temp_path = path + ".tmp." + std::to_string(get_process_id()) + "." + std::to_string(temp_counter++);
+
+    std::ofstream ofs(temp_path, std::ios::binary);
+    if (!ofs)
+        return false;
+    ofs << content;
+
+    ofs.close();
+    if (!ofs.good()){
+        fs::remove(temp_path, ec);
+        return false;
+    }
+
+    fs::rename(temp_path, path, ec);
+    if (ec){
+        fs::remove(temp_path, ec);
+        return false;
+    }
+
+    return true;
+}
@@ -9,6 +9,9 @@
 #include <set>
 #include <list>
 #include <memory>
+#include <sstream>
+#include <mutex>
+#include <chrono>
 
 #include "glslang/Public/ShaderLang.h"
 #include "glslang/Public/ResourceLimits.h"
@@ -26,17 +29,30 @@
 using namespace supershader;
 
 
-// TODO: can be replaced with glslang/MachineIndependent/DirStackFileIncluder.h
-class FileIncluder : public glslang::TShader::Includer {
-private:
-    std::vector<std::string> localDirectories;
+// Keeps included files of all parsed stages
+class TrackedIncluder : public glslang::TShader::Includer {
+protected:
     std::set<std::string> includedFiles;
 
-    IncludeResult* newIncludeResult(const std::string& path, std::ifstream& file, int length) const {
-        char* content = new char [length];
-        file.seekg(0, file.beg);
-        file.read(content, length);
-        return new IncludeResult(path, content, length, content);
+    void addIncludedFile(const std::string& path) {
+        includedFiles.insert(path);
+    }
+
+public:
+    std::set<std::string> getIncludedFiles() const {
+        return includedFiles;
+    }
+};
+
+// Headers are searched in directory of stage file, then in include directories, for any depth
+class FileIncluder : public TrackedIncluder {
+private:
+    include_resolver_t resolver;
+    std::string stageDirectory;
+
+    // Views of shared cache, no copy for each include
+    IncludeResult* newIncludeResult(const std::string& path, const std::shared_ptr<const file_content_t>& content) const {
+        return new IncludeResult(path, content->data, content->size, new std::shared_ptr<const file_content_t>(content));
     }
 
     std::string getDirectory(const std::string path) const {
@@ -45,25 +61,26 @@ private:
     }
 
 public:
+    FileIncluder(const std::vector<std::string>& includeDirectories) {
+        resolver.directories = includeDirectories;
+    }
+
     virtual IncludeResult* includeLocal(const char* headerName, 
                                         const char* includerName, 
                                         size_t inclusionDepth) override {
-        
-        localDirectories.resize((int)inclusionDepth + (int)localDirectories.size());
         if (inclusionDepth == 1)
-            localDirectories.back() = getDirectory(includerName);
-
-        for (auto it = localDirectories.rbegin(); it != localDirectories.rend(); ++it) {
-            std::string path = *it + '/' + headerName;
-            std::replace(path.begin(), path.end(), '\\', '/');
-            std::ifstream file(path, std::ios_base::binary | std::ios_base::ate);
-            if (file) {
-                includedFiles.insert(path);
-                return newIncludeResult(path, file, (int)file.tellg());
-            }
-        }
+            stageDirectory = getDirectory(includerName);
 
-        return nullptr;
+        std::string path;
+        if (!resolve_include(path, resolver, stageDirectory, headerName))
+            return nullptr;
+
+        std::shared_ptr<const file_content_t> content = get_cached_file(path);
+        if (!content)
+            return nullptr;
+
+        addIncludedFile(path);
+        return newIncludeResult(path, content);
     }
 
      // Not using search for a <system> path.
@@ -75,26 +92,17 @@ public:
 
     virtual void releaseInclude(IncludeResult* result) override {
         if (result != nullptr) {
-            delete [] static_cast<char*>(result->userData);
+            delete static_cast<std::shared_ptr<const file_content_t>*>(result->userData);
             delete result;
         }
     }
 
     virtual ~FileIncluder() override { }
-
-    void addLocalDirectory(const std::string& dir) {
-        localDirectories.push_back(dir);
-    }
-
-    virtual std::set<std::string> getIncludedFiles() {
-        return includedFiles;
-    }
 };
 
-class BufferIncluder : public glslang::TShader::Includer {
+class BufferIncluder : public TrackedIncluder {
 private:
     const std::unordered_map<std::string, std::string>& fileBuffers;
-    std::set<std::string> includedFiles;
 
     IncludeResult* newIncludeResult(const std::string& path, const std::string& content) const {
         char* data = new char[content.size()];
@@ -112,7 +120,7 @@ public:
         std::string path(headerName);
         auto it = fileBuffers.find(path);
         if (it != fileBuffers.end()) {
-            includedFiles.insert(path);
+            addIncludedFile(path);
             return newIncludeResult(path, it->second);
         }
         return nullptr;
@@ -133,26 +141,24 @@ public:
     }
 
     virtual ~BufferIncluder() override { }
-
-    virtual std::set<std::string> getIncludedFiles() {
-        return includedFiles;
-    }
 };
 
 
 extern const TBuiltInResource DefaultTBuiltInResource;
 
+static const int DefaultVersion = 100; // 110 for desktop
+
 static void output_error(const char* str, const char* header){
     if (str && str[0]){
-        fprintf(stderr, "%s\n", header);
-        fprintf(stderr, "%s\n", str);
+        print_error("%s\n", header);
+        print_error("%s\n", str);
     }
 }
 
 static void output_included_files(const std::set<std::string>& includedFiles){
-    fprintf(stdout, "Included files:\n");
+    print_info("Included files:\n");
     for(auto f : includedFiles) {
-        fprintf(stdout, "%s\n", f.c_str());
+        print_info("%s\n", f.c_str());
     }
 }
 
@@ -172,7 +178,7 @@ static EShLanguage get_stage(stage_type_t stage_type){
     }else if (stage_type == STAGE_FRAGMENT){
         return EShLangFragment;
     }else{
-        fprintf(stderr, "Not a valid stage input type");
+        print_error("Not a valid stage input type");
         return EShLangVertex;
     }
 }
@@ -198,6 +204,59 @@ static void add_defines(glslang::TShader* shader, const args_t& args, std::strin
     shader->addProcesses(processes);
 }
 
+// Optimization of target, targets with same key and preamble share SPIR-V
+std::string supershader::get_optimization_key(const args_t& args){
+    if (!args.passes.empty()){
+        std::string key = "passes";
+        for (const std::string& pass : args.passes){
+            key += " " + pass;
+        }
+        return key;
+    }
+
+    if (args.opt_level == OPT_LEVEL_NONE){
+        return "O0";
+    }else if (args.opt_level == OPT_LEVEL_SIZE){
+        return "Os";
+    }else if (args.opt_level == OPT_LEVEL_PERF){
+        return "Operf";
+    }
+
+    return "O1";
+}
+
+// Only these defines change the SPIR-V between output langs,
+// so targets with same preamble can share the same SPIR-V
+std::string supershader::get_lang_preamble(const args_t& args){
+    std::string def;
+
+    if (args.lang == LANG_GLSL && args.version == 100) {
+        def += std::string("#define flat\n");
+    }
+
+    if (args.lang == LANG_GLSL){
+        def += std::string("#define IS_GLSL\n");
+        if (args.es){
+            def += std::string("#define IS_GLES\n");
+        }
+    }else if (args.lang == LANG_HLSL){
+        def += std::string("#define IS_HLSL\n");
+    }else if (args.lang == LANG_MSL){
+        def += std::string("#define IS_MSL\n");
+    }
+
+    return def;
+}
+
+static glslang::SpvOptions get_spv_options(){
+    glslang::SpvOptions spv_opts;
+    spv_opts.validate = true;
+    spv_opts.optimizeSize = true;
+    // Disable this glslang internal optimizer that is broken with WEBGL1 and HLSL shaders
+    spv_opts.disableOptimizer = true;
+    return spv_opts;
+}
+
 #if ENABLE_OPT
 //
 // Start modified part of SpvTools.cpp/SpirvToolsTransform to work with WEBGL1 and HLSL shaders
@@ -208,7 +267,7 @@ static void add_defines(glslang::TShader* shader, const args_t& args, std::strin
 void OptimizerMesssageConsumer(spv_message_level_t level, const char *source,
         const spv_position_t &position, const char *message)
 {
-    auto &out = std::cerr;
+    std::ostringstream out;
     switch (level)
     {
     case SPV_MSG_FATAL:
@@ -236,73 +295,247 @@ void OptimizerMesssageConsumer(spv_message_level_t level, const char *source,
         out << " " << message;
     }
     out << std::endl;
+    print_error("%s", out.str().c_str());
 }
 
-// Apply the SPIRV-Tools optimizer to generated SPIR-V.  HLSL SPIR-V is legalized in the process.
-void spirv_optimize(const glslang::TIntermediate& intermediate, std::vector<unsigned int>& spirv,
-                         spv::SpvBuildLogger* logger, const glslang::SpvOptions* options)
-{
-    spv_target_env target_env = glslang::MapToSpirvToolsEnv(intermediate.getSpv(), logger);
+// Each step registers one pass (or a level), so passes can run and be measured one by one
+typedef std::function<bool(spvtools::Optimizer&)> pass_step_t;
+
+static pass_step_t pass_token_step(spvtools::Optimizer::PassToken&& token){
+    std::shared_ptr<spvtools::Optimizer::PassToken> shared = std::make_shared<spvtools::Optimizer::PassToken>(std::move(token));
+    return [shared](spvtools::Optimizer& optimizer){
+        optimizer.RegisterPass(std::move(*shared));
+        return true;
+    };
+}
+
+static pass_step_t pass_flag_step(const std::string& flag){
+    return [flag](spvtools::Optimizer& optimizer){
+        return optimizer.RegisterPassFromFlag(flag);
+    };
+}
+
+// Conservative passes, MergeReturn, inlining, BlockMerge and LocalMultiStoreElim are broken with WEBGL1 and HLSL shaders
+static void add_default_passes(std::vector<pass_step_t>& steps, const glslang::SpvOptions* options){
+    steps.push_back(pass_token_step(spvtools::CreateWrapOpKillPass()));
+    steps.push_back(pass_token_step(spvtools::CreateDeadBranchElimPass()));
+    steps.push_back(pass_token_step(spvtools::CreateEliminateDeadFunctionsPass()));
+    steps.push_back(pass_token_step(spvtools::CreateScalarReplacementPass()));
+    steps.push_back(pass_token_step(spvtools::CreateLocalAccessChainConvertPass()));
+    steps.push_back(pass_token_step(spvtools::CreateLocalSingleBlockLoadStoreElimPass()));
+    steps.push_back(pass_token_step(spvtools::CreateLocalSingleStoreElimPass()));
+    steps.push_back(pass_token_step(spvtools::CreateSimplificationPass()));
+    steps.push_back(pass_token_step(spvtools::CreateAggressiveDCEPass()));
+    steps.push_back(pass_token_step(spvtools::CreateVectorDCEPass()));
+    steps.push_back(pass_token_step(spvtools::CreateDeadInsertElimPass()));
+    steps.push_back(pass_token_step(spvtools::CreateAggressiveDCEPass()));
+    steps.push_back(pass_token_step(spvtools::CreateDeadBranchElimPass()));
+    steps.push_back(pass_token_step(spvtools::CreateIfConversionPass()));
+    steps.push_back(pass_token_step(spvtools::CreateSimplificationPass()));
+    steps.push_back(pass_token_step(spvtools::CreateAggressiveDCEPass()));
+    steps.push_back(pass_token_step(spvtools::CreateVectorDCEPass()));
+    steps.push_back(pass_token_step(spvtools::CreateDeadInsertElimPass()));
+    steps.push_back(pass_token_step(spvtools::CreateInterpolateFixupPass()));
+    if (options->optimizeSize) {
+        steps.push_back(pass_token_step(spvtools::CreateRedundancyEliminationPass()));
+        steps.push_back(pass_token_step(spvtools::CreateEliminateDeadInputComponentsSafePass()));
+    }
+    steps.push_back(pass_token_step(spvtools::CreateAggressiveDCEPass()));
+    steps.push_back(pass_token_step(spvtools::CreateCFGCleanupPass()));
+}
 
-    spvtools::Optimizer optimizer(target_env);
-    optimizer.SetMessageConsumer(OptimizerMesssageConsumer);
+static void register_level_passes(spvtools::Optimizer& optimizer, opt_level_t level){
+    if (level == OPT_LEVEL_PERF){
+        optimizer.RegisterPerformancePasses();
+    }else{
+        optimizer.RegisterSizePasses();
+    }
+}
+
+// Level passes are split by their names, that are also their flags. If one is not, level runs as a single step.
+static void add_level_passes(std::vector<pass_step_t>& steps, opt_level_t level, spv_target_env target_env, bool split){
+    if (split){
+        spvtools::Optimizer names(target_env);
+        register_level_passes(names, level);
+
+        std::vector<std::string> flags;
+        spvtools::Optimizer check(target_env);
+        for (const char* name : names.GetPassNames()){
+            flags.push_back(std::string("--") + name);
+            if (!check.RegisterPassFromFlag(flags.back())){
+                flags.clear();
+                break;
+            }
+        }
+
+        if (!flags.empty()){
+            for (const std::string& flag : flags){
+                steps.push_back(pass_flag_step(flag));
+            }
+            return;
+        }
+    }
+
+    steps.push_back([level](spvtools::Optimizer& optimizer){
+        register_level_passes(optimizer, level);
+        return true;
+    });
+}
+
+static std::vector<pass_step_t> get_pass_steps(spv_target_env target_env, const glslang::SpvOptions* options, const args_t& args, bool split){
+    std::vector<pass_step_t> steps;
 
     // If debug (specifically source line info) is being generated, propagate
     // line information into all SPIR-V instructions. This avoids loss of
     // information when instructions are deleted or moved. Later, remove
     // redundant information to minimize final SPRIR-V size.
     if (options->stripDebugInfo) {
-        optimizer.RegisterPass(spvtools::CreateStripDebugInfoPass());
-    }
-    optimizer.RegisterPass(spvtools::CreateWrapOpKillPass());
-    optimizer.RegisterPass(spvtools::CreateDeadBranchElimPass());
-    //optimizer.RegisterPass(spvtools::CreateMergeReturnPass());
-    //optimizer.RegisterPass(spvtools::CreateInlineExhaustivePass());
-    optimizer.RegisterPass(spvtools::CreateEliminateDeadFunctionsPass());
-    optimizer.RegisterPass(spvtools::CreateScalarReplacementPass());
-    optimizer.RegisterPass(spvtools::CreateLocalAccessChainConvertPass());
-    optimizer.RegisterPass(spvtools::CreateLocalSingleBlockLoadStoreElimPass());
-    optimizer.RegisterPass(spvtools::CreateLocalSingleStoreElimPass());
-    optimizer.RegisterPass(spvtools::CreateSimplificationPass());
-    optimizer.RegisterPass(spvtools::CreateAggressiveDCEPass());
-    optimizer.RegisterPass(spvtools::CreateVectorDCEPass());
-    optimizer.RegisterPass(spvtools::CreateDeadInsertElimPass());
-    optimizer.RegisterPass(spvtools::CreateAggressiveDCEPass());
-    optimizer.RegisterPass(spvtools::CreateDeadBranchElimPass());
-    //optimizer.RegisterPass(spvtools::CreateBlockMergePass());
-    //optimizer.RegisterPass(spvtools::CreateLocalMultiStoreElimPass());
-    optimizer.RegisterPass(spvtools::CreateIfConversionPass());
-    optimizer.RegisterPass(spvtools::CreateSimplificationPass());
-    optimizer.RegisterPass(spvtools::CreateAggressiveDCEPass());
-    optimizer.RegisterPass(spvtools::CreateVectorDCEPass());
-    optimizer.RegisterPass(spvtools::CreateDeadInsertElimPass());
-    optimizer.RegisterPass(spvtools::CreateInterpolateFixupPass());
-    if (options->optimizeSize) {
-        optimizer.RegisterPass(spvtools::CreateRedundancyEliminationPass());
-        optimizer.RegisterPass(spvtools::CreateEliminateDeadInputComponentsSafePass());
+        steps.push_back(pass_token_step(spvtools::CreateStripDebugInfoPass()));
+    }
+    if (!args.passes.empty()){
+        for (const std::string& flag : args.passes){
+            steps.push_back(pass_flag_step(flag));
+        }
+    }else if (args.opt_level == OPT_LEVEL_PERF || args.opt_level == OPT_LEVEL_SIZE){
+        add_level_passes(steps, args.opt_level, target_env, split);
+        steps.push_back(pass_token_step(spvtools::CreateInterpolateFixupPass()));
+    }else{
+        add_default_passes(steps, options);
     }
-    optimizer.RegisterPass(spvtools::CreateAggressiveDCEPass());
-    optimizer.RegisterPass(spvtools::CreateCFGCleanupPass());
+
+    return steps;
+}
+
+// Runs each step alone, time includes reading and writing the module by optimizer
+static bool profile_pass_steps(stage_profile_t& profile, std::vector<pass_step_t>& steps, std::vector<unsigned int>& spirv,
+                         spv_target_env target_env, const spvtools::OptimizerOptions& spvOptOptions)
+{
+    for (pass_step_t& step : steps){
+        spvtools::Optimizer optimizer(target_env);
+        optimizer.SetMessageConsumer(OptimizerMesssageConsumer);
+        if (!step(optimizer)){
+            print_error("Invalid passes in pass recipe\n");
+            return false;
+        }
+
+        pass_profile_t pass;
+        for (const char* name : optimizer.GetPassNames()){
+            pass.name += (pass.name.empty() ? "" : ",") + std::string(name);
+        }
+        pass.before = get_spirv_stats(spirv);
+
+        auto start = std::chrono::steady_clock::now();
+        if (!optimizer.Run(spirv.data(), spirv.size(), &spirv, spvOptOptions)){
+            print_error("Optimizer failed in pass %s\n", pass.name.c_str());
+            return false;
+        }
+        pass.time_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        pass.after = get_spirv_stats(spirv);
+        profile.passes.push_back(pass);
+    }
+
+    return true;
+}
+
+static bool run_optimizer(std::vector<unsigned int>& spirv, spv_target_env target_env, const glslang::SpvOptions* options, const args_t& args, stage_profile_t* profile)
+{
+    std::vector<pass_step_t> steps = get_pass_steps(target_env, options, args, profile != nullptr);
 
     spvtools::OptimizerOptions spvOptOptions;
     if (options->optimizerAllowExpandedIDBound)
         spvOptOptions.set_max_id_bound(0x3FFFFFFF);
-    optimizer.SetTargetEnv(glslang::MapToSpirvToolsEnv(intermediate.getSpv(), logger));
     spvOptOptions.set_run_validator(false); // The validator may run as a separate step later on
-    optimizer.Run(spirv.data(), spirv.size(), &spirv, spvOptOptions);
+
+    if (profile){
+        if (!profile_pass_steps(*profile, steps, spirv, target_env, spvOptOptions))
+            return false;
+    }else{
+        spvtools::Optimizer optimizer(target_env);
+        optimizer.SetMessageConsumer(OptimizerMesssageConsumer);
+        for (pass_step_t& step : steps){
+            if (!step(optimizer)){
+                print_error("Invalid passes in pass recipe\n");
+                return false;
+            }
+        }
+        if (!optimizer.Run(spirv.data(), spirv.size(), &spirv, spvOptOptions)){
+            print_error("Optimizer failed\n");
+            return false;
+        }
+    }
 
     if (options->optimizerAllowExpandedIDBound) {
         if (spirv.size() > 3 && spirv[3] > kDefaultMaxIdBound) {
             spvtools::Optimizer optimizer2(target_env);
             optimizer2.SetMessageConsumer(OptimizerMesssageConsumer);
             optimizer2.RegisterPass(spvtools::CreateCompactIdsPass());
-            optimizer2.Run(spirv.data(), spirv.size(), &spirv, spvOptOptions);
+            if (!optimizer2.Run(spirv.data(), spirv.size(), &spirv, spvOptOptions)){
+                print_error("Optimizer failed compacting ids\n");
+                return false;
+            }
         }
     }
+
+    return true;
+}
+
+// Apply the SPIRV-Tools optimizer to generated SPIR-V.  HLSL SPIR-V is legalized in the process.
+// Passes are from optimization level or pass recipe of target, with a profile they run one by one.
+bool spirv_optimize(const glslang::TIntermediate& intermediate, std::vector<unsigned int>& spirv,
+                         spv::SpvBuildLogger* logger, const glslang::SpvOptions* options, const args_t& args, stage_profile_t* profile)
+{
+    spv_target_env target_env = glslang::MapToSpirvToolsEnv(intermediate.getSpv(), logger);
+
+    return run_optimizer(spirv, target_env, options, args, profile);
 }
 //
 // End modified part of SpvTools.cpp/SpirvToolsTransform
 //
+
+// Same environment of compile_to_spirv, that targets Vulkan 1.0
+static const spv_target_env SpirvTargetEnv = SPV_ENV_VULKAN_1_0;
+
+bool supershader::optimize_spirv(spirv_t& spirv, const args_t& args){
+    glslang::SpvOptions spv_opts = get_spv_options();
+    return run_optimizer(spirv.bytecode, SpirvTargetEnv, &spv_opts, args, nullptr);
+}
+
+bool supershader::get_optimization_passes(std::vector<std::string>& passes, const args_t& args){
+    glslang::SpvOptions spv_opts = get_spv_options();
+
+    passes.clear();
+    for (pass_step_t& step : get_pass_steps(SpirvTargetEnv, &spv_opts, args, true)){
+        spvtools::Optimizer optimizer(SpirvTargetEnv);
+        if (!step(optimizer))
+            return false;
+
+        for (const char* name : optimizer.GetPassNames()){
+            std::string flag = std::string("--") + name;
+            spvtools::Optimizer check(SpirvTargetEnv);
+            if (!check.RegisterPassFromFlag(flag)){
+                print_error("Pass %s has no spirv-opt flag\n", name);
+                return false;
+            }
+            passes.push_back(flag);
+        }
+    }
+
+    return true;
+}
+
+#else
+
+bool supershader::optimize_spirv(spirv_t&, const args_t&){
+    print_error("SPIR-V optimization needs spirv-opt, build with ENABLE_OPT\n");
+    return false;
+}
+
+bool supershader::get_optimization_passes(std::vector<std::string>&, const args_t&){
+    print_error("SPIR-V optimization needs spirv-opt, build with ENABLE_OPT\n");
+    return false;
+}
+
 #endif
 
 //
@@ -425,76 +658,219 @@ const TBuiltInResource DefaultTBuiltInResource = {
         /* .generalConstantMatrixVectorIndexing = */ 1,
     }};
 
-bool supershader::compile_to_spirv(std::vector<spirv_t>& spirvvec, const std::vector<input_t>& inputs, const args_t& args){
-    glslang::InitializeProcess();
+static std::mutex process_mutex;
+static int process_references = 0;
 
-    std::list<glslang::TShader*> shaders;
+// glslang process state (as built-in symbol tables) is created by first reference
+// and kept alive until last one, so compiles of many threads share it
+void supershader::initialize_process(){
+    std::lock_guard<std::mutex> lock(process_mutex);
+    if (process_references++ == 0)
+        glslang::InitializeProcess();
+}
+
+// Pools of SPIR-V generation, their free pages are reused by next compiles
+static std::vector<glslang::TPoolAllocator*> free_pools;
+
+void supershader::finalize_process(){
+    std::lock_guard<std::mutex> lock(process_mutex);
+    if (process_references > 0 && --process_references == 0){
+        glslang::FinalizeProcess();
 
-    std::unique_ptr<glslang::TShader::Includer> includer;
-    if (args.useBuffers) {
-        includer = std::make_unique<BufferIncluder>(args.fileBuffers);
-    } else {
-        includer = std::make_unique<FileIncluder>();
-        if (!args.include_dir.empty())
-            static_cast<FileIncluder*>(includer.get())->addLocalDirectory(args.include_dir);
+        for (glslang::TPoolAllocator* pool : free_pools){
+            delete pool;
+        }
+        free_pools.clear();
     }
+}
 
-    glslang::TProgram* program = new glslang::TProgram;
+// Stage threads are short lived, a pool from process is used instead of a new one of thread
+struct pool_reference_t{
+    glslang::TPoolAllocator* previous;
+    glslang::TPoolAllocator* pool = nullptr;
+
+    pool_reference_t(){
+        previous = &glslang::GetThreadPoolAllocator();
+        {
+            std::lock_guard<std::mutex> lock(process_mutex);
+            if (!free_pools.empty()){
+                pool = free_pools.back();
+                free_pools.pop_back();
+            }
+        }
+        if (!pool)
+            pool = new glslang::TPoolAllocator;
+        glslang::SetThreadPoolAllocator(pool);
+    }
 
-    EShMessages messages = EShMsgDefault;
-    int default_version = 100; // 110 for desktop
+    ~pool_reference_t(){
+        glslang::SetThreadPoolAllocator(previous);
+
+        std::lock_guard<std::mutex> lock(process_mutex);
+        free_pools.push_back(pool);
+    }
+};
+
+static std::unique_ptr<TrackedIncluder> create_includer(const args_t& args){
+    if (args.useBuffers)
+        return std::make_unique<BufferIncluder>(args.fileBuffers);
+
+    return std::make_unique<FileIncluder>(args.include_dirs);
+}
+
+// Preamble of all stages before user defines
+static std::string get_base_preamble(const args_t& args){
+    std::string def("#extension GL_GOOGLE_include_directive : require\n");
 
     // To be used in layout(location = SEMANTIC) for HLSL
-    std::string semantics_def;
     for (int i = 0; i < VERTEX_ATTRIB_COUNT; i++) {
-        semantics_def += std::string("#define " + std::string(k_attrib_names[i]) + " " + std::to_string(i) + "\n");
+        def += std::string("#define " + std::string(k_attrib_names[i]) + " " + std::to_string(i) + "\n");
     }
 
     // For more HLSL compatibility
     for (int i = 0; i < 8; i++) {
-        semantics_def += std::string("#define SV_Target" + std::to_string(i) + " " + std::to_string(i) + "\n");
+        def += std::string("#define SV_Target" + std::to_string(i) + " " + std::to_string(i) + "\n");
     }
 
-    for (int i = 0; i < inputs.size(); i++){
-        std::string def("#extension GL_GOOGLE_include_directive : require\n");
-        def += semantics_def;
+    def += get_lang_preamble(args);
 
-        if (args.lang == LANG_GLSL && args.version == 100) {
-            def += std::string("#define flat\n");
-        }
+    return def;
+}
+
+// Shader keeps pointers to these, they have to live until shader is parsed
+struct shader_strings_t{
+    std::string preamble;
+    const char* sources[1];
+    int sourcesLen[1];
+    const char* sourcesNames[1];
+};
+
+static void setup_shader(glslang::TShader* shader, shader_strings_t& strings, const input_t& input, const args_t& args){
+    EShLanguage stage = get_stage(input.stage_type);
+
+    strings.sources[0] = input.source.c_str();
+    strings.sourcesLen[0] = (int) input.source.length();
+    strings.sourcesNames[0] = input.filename.c_str();
 
-        if (args.lang == LANG_GLSL){
-            def += std::string("#define IS_GLSL\n");
-            if (args.es){
-                def += std::string("#define IS_GLES\n");
+    shader->setStringsWithLengthsAndNames(strings.sources, strings.sourcesLen, strings.sourcesNames, 1);
+    shader->setEnvInput(glslang::EShSourceGlsl, stage, glslang::EShClientVulkan, DefaultVersion);
+    shader->setEnvClient(glslang::EShClientVulkan, glslang::EShTargetVulkan_1_0);
+    shader->setEnvTarget(glslang::EshTargetSpv, glslang::EShTargetSpv_1_0);
+
+    shader->setAutoMapLocations(true);
+    shader->setAutoMapBindings(true);
+
+    add_defines(shader, args, strings.preamble);
+}
+
+// Only tokens are kept, comments, #line and whitespace changes give the same text
+static std::string normalize_source(const std::string& source){
+    std::string normalized;
+
+    std::stringstream ss(source);
+    std::string line;
+    while (std::getline(ss, line)){
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos)
+            continue;
+        if (line.compare(start, 5, "#line") == 0)
+            continue;
+
+        bool space = false;
+        for (size_t c = start; c < line.size(); c++){
+            if (line[c] == ' ' || line[c] == '\t' || line[c] == '\r'){
+                space = true;
+                continue;
             }
-        }else if (args.lang == LANG_HLSL){
-            def += std::string("#define IS_HLSL\n");
-        }else if (args.lang == LANG_MSL){
-            def += std::string("#define IS_MSL\n");
+            if (space)
+                normalized += ' ';
+            normalized += line[c];
+            space = false;
+        }
+        normalized += '\n';
+    }
+
+    return normalized;
+}
+
+bool supershader::preprocess_normalized(std::vector<std::string>& sources, std::set<std::string>& included_files, const std::vector<input_t>& inputs, const args_t& args){
+    process_reference_t process;
+
+    std::unique_ptr<TrackedIncluder> includer = create_includer(args);
+    std::string base_preamble = get_base_preamble(args);
+
+    sources.resize(inputs.size());
+    for (int i = 0; i < inputs.size(); i++){
+        shader_strings_t strings;
+        strings.preamble = base_preamble;
+
+        glslang::TShader shader(get_stage(inputs[i].stage_type));
+        setup_shader(&shader, strings, inputs[i], args);
+
+        // Errors are reported later by the real compile
+        std::string output;
+        if (!shader.preprocess(&DefaultTBuiltInResource, DefaultVersion, ENoProfile, false, false, EShMsgDefault, &output, *includer))
+            return false;
+
+        sources[i] = normalize_source(output);
+    }
+
+    std::set<std::string> includes = includer->getIncludedFiles();
+    included_files.insert(includes.begin(), includes.end());
+
+    return true;
+}
+
+bool supershader::compile_to_spirv(std::vector<spirv_t>& spirvvec, const std::vector<input_t>& inputs, const args_t& args){
+    std::set<std::string> included_files;
+    return compile_to_spirv(spirvvec, included_files, inputs, args);
+}
+
+bool supershader::compile_to_spirv(std::vector<spirv_t>& spirvvec, std::set<std::string>& included_files, const std::vector<input_t>& inputs, const args_t& request, const preprocessed_t* preprocessed){
+    args_t storage;
+    const args_t& args = resolve_deprecated_args(storage, request);
+
+    // glslang parse state is per thread, only process state is shared
+    process_reference_t process;
+
+    // Stage cache key needs normalized sources, preprocessed here only if caller has not done it
+    preprocessed_t local;
+    if (!args.cache_dir.empty() && !preprocessed){
+        if (preprocess_normalized(local.sources, local.included_files, inputs, args))
+            preprocessed = &local;
+    }
+
+    std::string key;
+    if (preprocessed && preprocessed->sources.size() == inputs.size()){
+        key = get_spirv_cache_key(inputs, preprocessed->sources, args);
+        if (load_cached_spirv(spirvvec, key, args)){
+            included_files.insert(preprocessed->included_files.begin(), preprocessed->included_files.end());
+            if (args.list_includes)
+                output_included_files(preprocessed->included_files);
+            return true;
         }
+    }
 
-        EShLanguage stage = get_stage(inputs[i].stage_type);
+    std::list<glslang::TShader*> shaders;
+
+    std::unique_ptr<TrackedIncluder> includer = create_includer(args);
 
-        glslang::TShader* shader = new glslang::TShader(stage);
+    glslang::TProgram* program = new glslang::TProgram;
 
-        const char* sources[1] = { inputs[i].source.c_str() };
-        const int sourcesLen[1] = { (int) inputs[i].source.length() };
-        const char* sourcesNames[1] = { inputs[i].filename.c_str() };
+    EShMessages messages = EShMsgDefault;
 
-        shader->setStringsWithLengthsAndNames(sources, sourcesLen, sourcesNames, 1);
-        shader->setEnvInput(glslang::EShSourceGlsl, stage, glslang::EShClientVulkan, default_version);
-        shader->setEnvClient(glslang::EShClientVulkan, glslang::EShTargetVulkan_1_0);
-        shader->setEnvTarget(glslang::EshTargetSpv, glslang::EShTargetSpv_1_0);
+    std::string base_preamble = get_base_preamble(args);
 
-        shader->setAutoMapLocations(true);
-        shader->setAutoMapBindings(true);
+    for (int i = 0; i < inputs.size(); i++){
+        shader_strings_t strings;
+        strings.preamble = base_preamble;
 
-        add_defines(shader, args, def);
+        glslang::TShader* shader = new glslang::TShader(get_stage(inputs[i].stage_type));
+        setup_shader(shader, strings, inputs[i], args);
 
         shaders.push_back(shader);
 
-        bool parse_success = shader->parse(&DefaultTBuiltInResource, default_version, false, messages, *includer);
+        bool parse_success = shader->parse(&DefaultTBuiltInResource, DefaultVersion, false, messages, *includer);
         output_error(shader->getInfoLog(), ("File: " + inputs[i].filename).c_str());
         output_error(shader->getInfoDebugLog(), ("File: " + inputs[i].filename).c_str());
         if (!parse_success) {
@@ -521,34 +897,69 @@ bool supershader::compile_to_spirv(std::vector<spirv_t>& spirvvec, const std::ve
         return false;
     }
 
-    for (int i = 0; i < inputs.size(); i++){
-
-        glslang::SpvOptions spv_opts;
-        spv_opts.validate = true;
-        spv_opts.optimizeSize = true;
-        // Disable this glslang internal optimizer that is broken with WEBGL1 and HLSL shaders
-        spv_opts.disableOptimizer = true;
+    // After link each stage has its own intermediate, code generation and optimization run in parallel
+    std::vector<char> results(inputs.size(), 0);
+    std::vector<std::vector<char>> matched(inputs.size(), std::vector<char>(args.spec_constants.size(), 0));
+    bool success = run_parallel(results, (int)inputs.size(), [&](size_t i){
+        glslang::SpvOptions spv_opts = get_spv_options();
         spv::SpvBuildLogger logger;
         const glslang::TIntermediate* im = program->getIntermediate(get_stage(inputs[i].stage_type));
         if (im){
-            glslang::GlslangToSpv(*im, spirvvec[i].bytecode, &logger, &spv_opts);
+            {
+                pool_reference_t pool;
+                glslang::GlslangToSpv(*im, spirvvec[i].bytecode, &logger, &spv_opts);
+            }
+            // Baked values are folded by optimizer like any constant
+            if (!specialize_spirv(spirvvec[i], matched[i], args))
+                return false;
             // It is the same of glslang optimizer with some parts removed
             #if ENABLE_OPT
-            if (args.optimization){
-                spirv_optimize(*im, spirvvec[i].bytecode, &logger, &spv_opts);
+            if (args.opt_level != OPT_LEVEL_NONE || !args.passes.empty()){
+                stage_profile_t profile;
+                if (!args.profile_passes.empty()){
+                    profile.program = args.program_name.empty() ? args.output_basename : args.program_name;
+                    profile.file = inputs[i].filename;
+                    profile.stage_type = inputs[i].stage_type;
+                    profile.optimization = get_optimization_key(args);
+                    for (const define_t& def : args.defines){
+                        profile.defines.push_back(def.value.empty() ? def.def : def.def + "=" + def.value);
+                    }
+                }
+
+                if (!spirv_optimize(*im, spirvvec[i].bytecode, &logger, &spv_opts, args, args.profile_passes.empty() ? nullptr : &profile))
+                    return false;
+
+                if (!args.profile_passes.empty())
+                    add_stage_profile(profile);
             }
             #endif
             if (!logger.getAllMessages().empty())
-                puts(logger.getAllMessages().c_str());
+                print_info("%s\n", logger.getAllMessages().c_str());
+        }
+        return true;
+    });
+
+    // A constant in no stage is a typo, nothing would be baked
+    for (size_t s = 0; success && s < args.spec_constants.size(); s++){
+        bool found = false;
+        for (size_t i = 0; i < inputs.size(); i++){
+            found = found || matched[i][s];
+        }
+        if (!found){
+            print_error("Specialization constant %s is not in any stage\n", args.spec_constants[s].def.c_str());
+            success = false;
         }
     }
 
+    // Cache is only an optimization, a failed store does not fail the compile
+    if (success && !key.empty())
+        store_cached_spirv(spirvvec, key, args);
+
+    std::set<std::string> includes = includer->getIncludedFiles();
+    included_files.insert(includes.begin(), includes.end());
     if (args.list_includes)
-        output_included_files(args.useBuffers 
-            ? static_cast<BufferIncluder*>(includer.get())->getIncludedFiles()
-            : static_cast<FileIncluder*>(includer.get())->getIncludedFiles());
+        output_included_files(includes);
 
     cleanup_program_shaders(program, shaders);
-    glslang::FinalizeProcess();
-    return true;
+    return success;
 }
@@ -0,0 +1,130 @@
+//
+// (c) 2024 Eduardo Doria.
+//
+
+#include "supershader.h"
+
+#include <cstring>
+#include <algorithm>
+
+using namespace supershader;
+
+//
+// SHA-256 as in FIPS 180-4
+//
+
+static const uint32_t k_sha256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x, int n){
+    return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_block(sha256_t& ctx, const unsigned char* block){
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++){
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) | ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++){
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = ctx.state[0], b = ctx.state[1], c = ctx.state[2], d = ctx.state[3];
+    uint32_t e = ctx.state[4], f = ctx.state[5], g = ctx.state[6], h = ctx.state[7];
+
+    for (int i = 0; i < 64; i++){
+        uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + k_sha256[i] + w[i];
+        uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    ctx.state[0] += a; ctx.state[1] += b; ctx.state[2] += c; ctx.state[3] += d;
+    ctx.state[4] += e; ctx.state[5] += f; ctx.state[6] += g; ctx.state[7] += h;
+}
+
+void supershader::sha256_init(sha256_t& ctx){
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx.state, initial, sizeof(initial));
+    ctx.length = 0;
+    ctx.buffer_size = 0;
+}
+
+void supershader::sha256_update(sha256_t& ctx, const void* data, size_t size){
+    const unsigned char* bytes = (const unsigned char*)data;
+    ctx.length += size;
+
+    while (size > 0){
+        size_t n = std::min(size, sizeof(ctx.buffer) - ctx.buffer_size);
+        memcpy(ctx.buffer + ctx.buffer_size, bytes, n);
+        ctx.buffer_size += n;
+        bytes += n;
+        size -= n;
+
+        if (ctx.buffer_size == sizeof(ctx.buffer)){
+            sha256_block(ctx, ctx.buffer);
+            ctx.buffer_size = 0;
+        }
+    }
+}
+
+// Strings are length prefixed, so fields cannot shift into each other
+void supershader::sha256_update(sha256_t& ctx, const std::string& str){
+    unsigned char size[8];
+    for (int i = 0; i < 8; i++){
+        size[i] = (unsigned char)((uint64_t)str.size() >> (i * 8));
+    }
+    sha256_update(ctx, size, sizeof(size));
+    sha256_update(ctx, str.data(), str.size());
+}
+
+std::string supershader::sha256_final(sha256_t& ctx){
+    uint64_t bits = ctx.length * 8;
+
+    unsigned char pad = 0x80;
+    sha256_update(ctx, &pad, 1);
+    pad = 0;
+    while (ctx.buffer_size != 56){
+        sha256_update(ctx, &pad, 1);
+    }
+
+    unsigned char length[8];
+    for (int i = 0; i < 8; i++){
+        length[i] = (unsigned char)(bits >> (56 - i * 8));
+    }
+    sha256_update(ctx, length, 8);
+
+    static const char* hex = "0123456789abcdef";
+    std::string digest;
+    for (int i = 0; i < 8; i++){
+        for (int shift = 28; shift >= 0; shift -= 4){
+            digest += hex[(ctx.state[i] >> shift) & 0xf];
+        }
+    }
+
+    return digest;
+}
+
+std::string supershader::sha256(const std::string& data){
+    sha256_t ctx;
+    sha256_init(ctx);
+    sha256_update(ctx, data.data(), data.size());
+    return sha256_final(ctx);
+}
@@ -16,7 +16,7 @@ static bool load_string_from_file(std::string& buffer, std::string path){
   	if (ifs.is_open()){
         buffer.assign(std::istreambuf_iterator<char>(ifs) ,std::istreambuf_iterator<char>());
     }else{
-        fprintf(stderr, "Unable to open file: %s\n", path.c_str());
+        print_error("Unable to open file: %s\n", path.c_str());
         return false;
     }
 
@@ -0,0 +1,133 @@
+//
+// (c) 2024 Eduardo Doria.
+//
+
+#include "supershader.h"
+
+#include <mutex>
+#include <cstring>
+#include <cerrno>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#endif
+
+using namespace supershader;
+
+static std::once_flag jobserver_once;
+static bool jobserver_active = false;
+static int jobserver_read_fd = -1;
+static int jobserver_write_fd = -1;
+
+#ifndef _WIN32
+
+static std::string get_jobserver_auth(const char* makeflags){
+    std::string flags(makeflags);
+    std::string auth;
+
+    // Last one wins, older make uses --jobserver-fds
+    for (const char* option : {"--jobserver-fds=", "--jobserver-auth="}){
+        size_t pos = flags.rfind(option);
+        if (pos != std::string::npos){
+            pos += strlen(option);
+            auth = flags.substr(pos, flags.find(' ', pos) - pos);
+        }
+    }
+
+    return auth;
+}
+
+static void initialize_jobserver(){
+    const char* makeflags = getenv("MAKEFLAGS");
+    if (!makeflags)
+        return;
+
+    std::string auth = get_jobserver_auth(makeflags);
+    if (auth.empty())
+        return;
+
+    if (auth.rfind("fifo:", 0) == 0){
+        std::string path = auth.substr(5);
+        int fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0){
+            print_error("Unable to open jobserver fifo %s: %s\n", path.c_str(), strerror(errno));
+            return;
+        }
+        jobserver_read_fd = fd;
+        jobserver_write_fd = fd;
+    }else{
+        int read_fd;
+        int write_fd;
+        if (sscanf(auth.c_str(), "%d,%d", &read_fd, &write_fd) != 2)
+            return;
+
+        // Make does not pass the pipe to commands not marked as recursive
+        if (fcntl(read_fd, F_GETFD) < 0 || fcntl(write_fd, F_GETFD) < 0)
+            return;
+
+        // Own file description to not change blocking mode of the pipe shared with make
+        std::string proc_path = "/proc/self/fd/" + std::to_string(read_fd);
+        int fd = open(proc_path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0){
+            // Without /proc (macOS) a blocking pipe would stall waiting threads, client is disabled
+            int flags = fcntl(read_fd, F_GETFL);
+            if (flags < 0 || !(flags & O_NONBLOCK))
+                return;
+            fd = read_fd;
+        }
+        jobserver_read_fd = fd;
+        jobserver_write_fd = write_fd;
+    }
+
+    jobserver_active = true;
+}
+
+#endif
+
+bool supershader::jobserver_enabled(){
+#ifndef _WIN32
+    std::call_once(jobserver_once, initialize_jobserver);
+#endif
+    return jobserver_active;
+}
+
+bool supershader::jobserver_try_acquire(char& token){
+    if (!jobserver_enabled())
+        return false;
+
+#ifndef _WIN32
+    // Other clients can take the token first, read is non-blocking
+    ssize_t n;
+    while ((n = read(jobserver_read_fd, &token, 1)) < 0 && errno == EINTR);
+
+    return n == 1;
+#else
+    return false;
+#endif
+}
+
+bool supershader::jobserver_acquire(char& token, const std::function<bool()>& needed){
+    if (!jobserver_enabled())
+        return false;
+
+#ifndef _WIN32
+    while (needed()){
+        if (jobserver_try_acquire(token))
+            return true;
+
+        pollfd pfd = {jobserver_read_fd, POLLIN, 0};
+        if (poll(&pfd, 1, JobserverPollMs) < 0 && errno != EINTR)
+            return false;
+    }
+#endif
+
+    return false;
+}
+
+void supershader::jobserver_release(char token){
+#ifndef _WIN32
+    while (write(jobserver_write_fd, &token, 1) < 0 && errno == EINTR);
+#endif
+}
@@ -6,7 +6,7 @@
 
 #include "nlohmann/json.hpp"
 #include <iomanip>
-#include <fstream>
+#include <cstring>
 
 using namespace supershader;
 
@@ -38,23 +38,15 @@ static std::string gen_shader_file(std::string directory, std::string basefilena
     std::string filename = basefilename + "_" + stage_to_string(stage) + "." + lang_to_string(lang);
     std::string path = directory + filename;
 
-    std::ofstream ofs(path);
-    if (!ofs) {
-        fprintf(stderr, "Cannot open file %s\n", path.c_str());
-    }
-
-    ofs << source << std::endl;
-
-    ofs.close();
-    if (!ofs.good()) {
-        fprintf(stderr, "Writing to file %s failed\n", path.c_str());
+    if (!write_output_file(path, source + "\n")) {
+        print_error("Writing to file %s failed\n", path.c_str());
     }
 
     return filename;
 }
 
-static std::string get_json_path(std::string directory, std::string basefilename, lang_type_t lang){
-    std::string path = directory + basefilename + "_" + lang_to_string(lang) + ".json";
+std::string supershader::get_json_file(const args_t& args){
+    std::string path = args.output_dir + args.output_basename + "_" + lang_to_string(args.lang) + ".json";
 
     return path;
 }
@@ -118,6 +110,34 @@ static std::string storage_buffer_type_to_string(storage_buffer_type_t type){
     return "";
 }
 
+static std::string spec_constant_type_to_string(spec_constant_type_t type){
+    if (type == spec_constant_type_t::BOOL){
+        return "bool";
+    }else if (type == spec_constant_type_t::INT){
+        return "int";
+    }else if (type == spec_constant_type_t::UINT){
+        return "uint";
+    }else if (type == spec_constant_type_t::FLOAT){
+        return "float";
+    }else if (type == spec_constant_type_t::INVALID){
+        return "INVALID";
+    }
+    return "";
+}
+
+static json spec_constant_value_to_json(const s_spec_constant_t& sc){
+    if (sc.type == spec_constant_type_t::BOOL){
+        return sc.default_value != 0;
+    }else if (sc.type == spec_constant_type_t::INT){
+        return (int32_t)sc.default_value;
+    }else if (sc.type == spec_constant_type_t::FLOAT){
+        float f;
+        memcpy(&f, &sc.default_value, sizeof(f));
+        return f;
+    }
+    return sc.default_value;
+}
+
 static std::string texture_type_to_string(texture_type_t type){
     if (type == texture_type_t::TEXTURE_2D){
         return "texture_2d";
@@ -160,7 +180,83 @@ static std::string sampler_type_to_string(sampler_type_t type){
 }
 
 
-bool supershader::generate_json(const std::vector<spirvcross_t>& spirvcrossvec, const std::vector<input_t>& inputs, const args_t& args){
+static stage_type_t string_to_stage(const std::string& str){
+    return (str == "fs") ? STAGE_FRAGMENT : STAGE_VERTEX;
+}
+
+static attribute_type_t string_to_attr_type(const std::string& str){
+    for (int t = attribute_type_t::FLOAT; t < attribute_type_t::INVALID; t++){
+        if (attr_type_to_string((attribute_type_t)t) == str)
+            return (attribute_type_t)t;
+    }
+    return attribute_type_t::INVALID;
+}
+
+static uniform_type_t string_to_uniform_type(const std::string& str){
+    for (int t = (int)uniform_type_t::FLOAT; t < (int)uniform_type_t::INVALID; t++){
+        if (uniform_type_to_string((uniform_type_t)t) == str)
+            return (uniform_type_t)t;
+    }
+    return uniform_type_t::INVALID;
+}
+
+static storage_buffer_type_t string_to_storage_buffer_type(const std::string& str){
+    for (int t = (int)storage_buffer_type_t::STRUCT; t < (int)storage_buffer_type_t::INVALID; t++){
+        if (storage_buffer_type_to_string((storage_buffer_type_t)t) == str)
+            return (storage_buffer_type_t)t;
+    }
+    return storage_buffer_type_t::INVALID;
+}
+
+static spec_constant_type_t string_to_spec_constant_type(const std::string& str){
+    for (int t = (int)spec_constant_type_t::BOOL; t < (int)spec_constant_type_t::INVALID; t++){
+        if (spec_constant_type_to_string((spec_constant_type_t)t) == str)
+            return (spec_constant_type_t)t;
+    }
+    return spec_constant_type_t::INVALID;
+}
+
+static uint32_t json_to_spec_constant_value(const json& vj, spec_constant_type_t type){
+    if (type == spec_constant_type_t::BOOL && vj.is_boolean()){
+        return vj.get<bool>() ? 1 : 0;
+    }else if (type == spec_constant_type_t::INT && vj.is_number_integer()){
+        return (uint32_t)vj.get<int32_t>();
+    }else if (type == spec_constant_type_t::FLOAT && vj.is_number()){
+        float f = vj.get<float>();
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        return bits;
+    }else if (vj.is_number_unsigned()){
+        return vj.get<uint32_t>();
+    }
+    return 0;
+}
+
+static texture_type_t string_to_texture_type(const std::string& str){
+    for (int t = (int)texture_type_t::TEXTURE_2D; t < (int)texture_type_t::INVALID; t++){
+        if (texture_type_to_string((texture_type_t)t) == str)
+            return (texture_type_t)t;
+    }
+    return texture_type_t::INVALID;
+}
+
+static texture_samplertype_t string_to_texture_samplertype(const std::string& str){
+    for (int t = (int)texture_samplertype_t::FLOAT; t < (int)texture_samplertype_t::INVALID; t++){
+        if (texture_samplertype_to_string((texture_samplertype_t)t) == str)
+            return (texture_samplertype_t)t;
+    }
+    return texture_samplertype_t::INVALID;
+}
+
+static sampler_type_t string_to_sampler_type(const std::string& str){
+    for (int t = (int)sampler_type_t::FILTERING; t < (int)sampler_type_t::INVALID; t++){
+        if (sampler_type_to_string((sampler_type_t)t) == str)
+            return (sampler_type_t)t;
+    }
+    return sampler_type_t::INVALID;
+}
+
+static json generate_json_object(const std::vector<spirvcross_t>& spirvcrossvec, const std::vector<input_t>& inputs, const args_t& args, bool inline_source){
     json j;
 
     j["language"] = lang_to_string(args.lang);
@@ -168,8 +264,14 @@ bool supershader::generate_json(const std::vector<spirvcross_t>& spirvcrossvec,
 
     for (int i = 0; i < spirvcrossvec.size(); i++){
         json sj;
-        sj["file"] = gen_shader_file(args.output_dir, args.output_basename, inputs[i].stage_type, args.lang, spirvcrossvec[i].source);
+        if (inline_source){
+            sj["source"] = spirvcrossvec[i].source;
+        }else{
+            sj["file"] = gen_shader_file(args.output_dir, args.output_basename, inputs[i].stage_type, args.lang, spirvcrossvec[i].source);
+        }
         sj["entry_point"] = spirvcrossvec[i].entry_point;
+        if (!spirvcrossvec[i].defines.empty())
+            sj["defines"] = spirvcrossvec[i].defines;
 
         for (int ia = 0; ia < spirvcrossvec[i].inputs.size(); ia++){
             s_attr_t attr = spirvcrossvec[i].inputs[ia];
@@ -258,29 +360,188 @@ bool supershader::generate_json(const std::vector<spirvcross_t>& spirvcrossvec,
             sbj["set"] = sb.set;
             sbj["binding"] = sb.binding;
             sbj["size_bytes"] = sb.size_bytes;
+            sbj["readonly"] = sb.readonly;
             sbj["type"] = storage_buffer_type_to_string(sb.type);
 
             sj["storage_buffers"].push_back(sbj);
         }
 
+        for (int isc = 0; isc < spirvcrossvec[i].spec_constants.size(); isc++){
+            s_spec_constant_t sc = spirvcrossvec[i].spec_constants[isc];
+            json scj;
+            scj["name"] = sc.name;
+            scj["constant_id"] = sc.constant_id;
+            scj["type"] = spec_constant_type_to_string(sc.type);
+            scj["default_value"] = spec_constant_value_to_json(sc);
+
+            sj["spec_constants"].push_back(scj);
+        }
+
 
         j[stage_to_string(inputs[i].stage_type)] = sj;
     }
 
+    return j;
+}
+
+bool supershader::generate_json(const std::vector<spirvcross_t>& spirvcrossvec, const std::vector<input_t>& inputs, const args_t& args){
+    json j = generate_json_object(spirvcrossvec, inputs, args, false);
 
-    std::string json_path = get_json_path(args.output_dir, args.output_basename, args.lang);
-    std::ofstream ofs(json_path);
-    if (!ofs) {
-        fprintf(stderr, "Cannot open file %s\n", json_path.c_str());
+    std::string json_path = get_json_file(args);
+    if (!write_output_file(json_path, j.dump(4) + "\n")) {
+        print_error("Writing to file %s failed\n", json_path.c_str());
         return false;
     }
-    ofs << j.dump(4) << std::endl;
 
-    ofs.close();
-    if (!ofs.good()) {
-        fprintf(stderr, "Writing to file %s failed\n", json_path.c_str());
+    return true;
+}
+
+bool supershader::generate_json_buffer(std::string& buffer, const std::vector<spirvcross_t>& spirvcrossvec, const std::vector<input_t>& inputs, const args_t& args){
+    json j = generate_json_object(spirvcrossvec, inputs, args, true);
+
+    buffer = j.dump();
+
+    return true;
+}
+
+static void parse_json_attrs(std::vector<s_attr_t>& attrs, const json& aj){
+    for (const json& a : aj){
+        s_attr_t attr;
+        attr.name = a.value("name", "");
+        attr.location = a.value("location", 0u);
+        if (a.contains("semantic_name")){
+            attr.semantic_name = a.value("semantic_name", "");
+            attr.semantic_index = a.value("semantic_index", 0u);
+        }else if (attr.location < VERTEX_ATTRIB_COUNT){
+            attr.semantic_name = k_attrib_sem_names[attr.location];
+            attr.semantic_index = k_attrib_sem_indices[attr.location];
+        }
+        attr.type = string_to_attr_type(a.value("type", ""));
+
+        attrs.push_back(attr);
+    }
+}
+
+// Reverse of generate_json_buffer, source has to be inline
+bool supershader::parse_json_buffer(std::vector<spirvcross_t>& spirvcrossvec, std::vector<input_t>& inputs, const std::string& buffer){
+    json j = json::parse(buffer, nullptr, false);
+    if (j.is_discarded() || !j.is_object()){
+        print_error("Invalid json shader buffer\n");
         return false;
     }
 
+    spirvcrossvec.clear();
+    inputs.clear();
+
+    for (auto& [key, sj] : j.items()){
+        if ((key != "vs" && key != "fs") || !sj.is_object())
+            continue;
+
+        spirvcross_t spirvcross;
+        spirvcross.stage_type = string_to_stage(key);
+        spirvcross.entry_point = sj.value("entry_point", "");
+        spirvcross.source = sj.value("source", "");
+        if (sj.contains("defines") && sj["defines"].is_array())
+            spirvcross.defines = sj["defines"].get<std::vector<std::string>>();
+
+        if (sj.contains("inputs"))
+            parse_json_attrs(spirvcross.inputs, sj["inputs"]);
+        if (sj.contains("outputs"))
+            parse_json_attrs(spirvcross.outputs, sj["outputs"]);
+
+        if (sj.contains("textures")){
+            for (const json& tj : sj["textures"]){
+                s_texture_t t;
+                t.name = tj.value("name", "");
+                t.set = tj.value("set", 0u);
+                t.binding = tj.value("binding", 0u);
+                t.type = string_to_texture_type(tj.value("type", ""));
+                t.sampler_type = string_to_texture_samplertype(tj.value("sampler_type", ""));
+
+                spirvcross.textures.push_back(t);
+            }
+        }
+
+        if (sj.contains("samplers")){
+            for (const json& smj : sj["samplers"]){
+                s_sampler_t sm;
+                sm.name = smj.value("name", "");
+                sm.set = smj.value("set", 0u);
+                sm.binding = smj.value("binding", 0u);
+                sm.type = string_to_sampler_type(smj.value("type", ""));
+
+                spirvcross.samplers.push_back(sm);
+            }
+        }
+
+        if (sj.contains("texture_sampler_pairs")){
+            for (const json& tsmj : sj["texture_sampler_pairs"]){
+                s_texture_sampler_pair_t tsm;
+                tsm.name = tsmj.value("name", "");
+                tsm.texture_name = tsmj.value("texture_name", "");
+                tsm.sampler_name = tsmj.value("sampler_name", "");
+
+                spirvcross.texture_sampler_pairs.push_back(tsm);
+            }
+        }
+
+        if (sj.contains("uniform_blocks")){
+            for (const json& ubj : sj["uniform_blocks"]){
+                s_uniform_block_t ub;
+                ub.name = ubj.value("name", "");
+                ub.inst_name = ubj.value("inst_name", "");
+                ub.set = ubj.value("set", 0u);
+                ub.binding = ubj.value("binding", 0u);
+                ub.size_bytes = ubj.value("size_bytes", 0u);
+                ub.flattened = ubj.value("flattened", false);
+
+                if (ubj.contains("uniforms")){
+                    for (const json& uj : ubj["uniforms"]){
+                        s_uniform_t u;
+                        u.name = uj.value("name", "");
+                        u.array_count = uj.value("array_count", 1u);
+                        u.offset = uj.value("offset", 0u);
+                        u.type = string_to_uniform_type(uj.value("type", ""));
+
+                        ub.uniforms.push_back(u);
+                    }
+                }
+
+                spirvcross.uniform_blocks.push_back(ub);
+            }
+        }
+
+        if (sj.contains("storage_buffers")){
+            for (const json& sbj : sj["storage_buffers"]){
+                s_storage_buffer_t sb;
+                sb.name = sbj.value("name", "");
+                sb.inst_name = sbj.value("inst_name", "");
+                sb.set = sbj.value("set", 0u);
+                sb.binding = sbj.value("binding", 0u);
+                sb.size_bytes = sbj.value("size_bytes", 0u);
+                sb.readonly = sbj.value("readonly", true);
+                sb.type = string_to_storage_buffer_type(sbj.value("type", ""));
+
+                spirvcross.storage_buffers.push_back(sb);
+            }
+        }
+
+        if (sj.contains("spec_constants")){
+            for (const json& scj : sj["spec_constants"]){
+                s_spec_constant_t sc;
+                sc.name = scj.value("name", "");
+                sc.constant_id = scj.value("constant_id", 0u);
+                sc.type = string_to_spec_constant_type(scj.value("type", ""));
+                if (scj.contains("default_value"))
+                    sc.default_value = json_to_spec_constant_value(scj["default_value"], sc.type);
+
+                spirvcross.spec_constants.push_back(sc);
+            }
+        }
+
+        inputs.push_back({spirvcross.stage_type, sj.value("file", ""), ""});
+        spirvcrossvec.push_back(spirvcross);
+    }
+
     return true;
 }
\ No newline at end of file
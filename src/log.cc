@@ -0,0 +1,56 @@
+//
+// (c) 2024 Eduardo Doria.
+//
+
+#include "supershader.h"
+
+#include <cstdarg>
+#include <mutex>
+
+using namespace supershader;
+
+static thread_local std::string* output_capture = nullptr;
+static std::mutex output_capture_mutex;
+
+static void print_message(FILE* stream, const char* format, va_list args){
+    if (!output_capture){
+        vfprintf(stream, format, args);
+        return;
+    }
+
+    va_list args_size;
+    va_copy(args_size, args);
+    int size = vsnprintf(nullptr, 0, format, args_size);
+    va_end(args_size);
+    if (size <= 0)
+        return;
+
+    std::string message(size, '\0');
+    vsnprintf(&message[0], size + 1, format, args);
+
+    // Same capture can be shared by worker threads of one compile
+    std::lock_guard<std::mutex> lock(output_capture_mutex);
+    output_capture->append(message);
+}
+
+void supershader::print_error(const char* format, ...){
+    va_list args;
+    va_start(args, format);
+    print_message(stderr, format, args);
+    va_end(args);
+}
+
+void supershader::print_info(const char* format, ...){
+    va_list args;
+    va_start(args, format);
+    print_message(stdout, format, args);
+    va_end(args);
+}
+
+void supershader::set_output_capture(std::string* capture){
+    output_capture = capture;
+}
+
+std::string* supershader::get_output_capture(){
+    return output_capture;
+}
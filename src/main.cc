@@ -16,39 +16,102 @@ int main(int argc, const char **argv){
 	if (!args.isValid)
 		return EXIT_FAILURE;
 
+	if (args.server){
+		if (!run_server(args))
+			return EXIT_FAILURE;
 
-	std::vector<input_t> inputs;
-	if (!load_input(inputs, args))
-		return EXIT_FAILURE;
+		return 0;
+	}
 
-	std::vector<spirv_t> spirvvec;
-	spirvvec.resize(inputs.size());
-	if (!compile_to_spirv(spirvvec, inputs, args))
-		return EXIT_FAILURE;
+	if (!args.merge_file.empty()){
+		if (!merge_batch_indices(args))
+			return EXIT_FAILURE;
 
-	if (spirvvec.size() != inputs.size()){
-		fprintf(stderr, "Error in pipeline when compile to SPIRV\n");
-		return EXIT_FAILURE;
+		return 0;
 	}
 
-	std::vector<spirvcross_t> spirvcrossvec;
-	spirvcrossvec.resize(inputs.size());
-	if (!compile_to_lang(spirvcrossvec, spirvvec, inputs, args))
-		return EXIT_FAILURE;
+	if (!args.scan_deps.empty()){
+		std::vector<args_t> programs;
+		if (!args.manifest_file.empty()){
+			if (!load_manifest(programs, args))
+				return EXIT_FAILURE;
+		}else if (args.scan_dir.empty()){
+			programs.push_back(args);
+		}
 
-	if (spirvcrossvec.size() != inputs.size()){
-		fprintf(stderr, "Error in pipeline when compile to shader lang\n");
-		return EXIT_FAILURE;
+		if (!scan_dependencies(programs, args))
+			return EXIT_FAILURE;
+
+		return 0;
 	}
 
-	if (args.output_type == OUTPUT_JSON){
-		if (!generate_json(spirvcrossvec, inputs, args))
+	if (!args.autotune.empty()){
+		std::vector<args_t> programs;
+		if (!args.manifest_file.empty()){
+			if (!load_manifest(programs, args))
+				return EXIT_FAILURE;
+		}else if (args.scan_dir.empty()){
+			programs.push_back(args);
+		}
+
+		if (!autotune_passes(programs, args))
 			return EXIT_FAILURE;
-	}else if (args.output_type == OUTPUT_BINARY){
-		if (!generate_sbs(spirvcrossvec, inputs, args))
+
+		return 0;
+	}
+
+	if (args.watch){
+		std::vector<args_t> programs;
+		if (!args.manifest_file.empty()){
+			if (!load_manifest(programs, args))
+				return EXIT_FAILURE;
+		}else{
+			programs.push_back(args);
+		}
+
+		if (!watch_programs(programs, args))
 			return EXIT_FAILURE;
+
+		return 0;
 	}
 
+	if (!args.manifest_file.empty()){
+		std::vector<args_t> programs;
+		if (!load_manifest(programs, args))
+			return EXIT_FAILURE;
+
+		if (args.shard_count > 0 && !select_shard(programs, args))
+			return EXIT_FAILURE;
+
+		bool success = compile_batch(programs, args);
+
+		if (args.cache_stats)
+			print_cache_stats(args);
+
+		if (!args.profile_passes.empty() && !write_pass_profile(args))
+			success = false;
+
+		if (!success)
+			return EXIT_FAILURE;
+
+		return 0;
+	}
+
+	if (args.skip_up_to_date && is_up_to_date(args)){
+		fprintf(stdout, "Up to date: %s\n", args.output_basename.c_str());
+		return 0;
+	}
+
+	bool success = compile_program(args);
+
+	if (args.cache_stats)
+		print_cache_stats(args);
+
+	if (!args.profile_passes.empty() && !write_pass_profile(args))
+		success = false;
+
+	if (!success)
+		return EXIT_FAILURE;
 
 	return 0;
 }
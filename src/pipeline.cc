@@ -0,0 +1,416 @@
+//
+// (c) 2024 Eduardo Doria.
+//
+
+#include "supershader.h"
+
+#include "nlohmann/json.hpp"
+#include <map>
+#include <algorithm>
+
+using namespace supershader;
+
+using json = nlohmann::ordered_json;
+
+// SPIR-V of each distinct lang preamble and optimization
+typedef std::map<std::string, std::vector<spirv_t>> preamble_spirv_t;
+
+std::vector<args_t> supershader::get_target_args(const args_t& args){
+    std::vector<target_t> targets = get_targets(args);
+
+    std::vector<args_t> targetargs(targets.size(), args);
+    for (int t = 0; t < targets.size(); t++){
+        apply_target(targetargs[t], targets[t]);
+        apply_pass_recipe(targetargs[t], targets[t]);
+        // Each target needs its own output files
+        if (targets.size() > 1)
+            targetargs[t].output_basename = args.output_basename + "_" + targets[t].name;
+    }
+
+    return targetargs;
+}
+
+// Targets with same preamble and optimization share SPIR-V
+static std::string get_spirv_key(const args_t& args){
+    return get_lang_preamble(args) + "\n" + get_optimization_key(args);
+}
+
+static bool compile_front_end(preamble_spirv_t& spirvs, std::set<std::string>& included_files, const std::vector<input_t>& inputs, const std::vector<args_t>& targetargs, bool list_includes, const preamble_preprocessed_t* preprocessed = nullptr){
+    // Run front-end once for each distinct preamble and optimization
+    for (int t = 0; t < targetargs.size(); t++){
+        std::string spirvkey = get_spirv_key(targetargs[t]);
+        if (spirvs.find(spirvkey) != spirvs.end())
+            continue;
+
+        args_t spirvargs = targetargs[t];
+        spirvargs.list_includes = list_includes && spirvs.empty();
+
+        // Sources preprocessed for cache key are not preprocessed again
+        const preprocessed_t* stages = nullptr;
+        if (preprocessed){
+            auto it = preprocessed->find(get_lang_preamble(spirvargs));
+            if (it != preprocessed->end())
+                stages = &it->second;
+        }
+
+        std::vector<spirv_t>& spirvvec = spirvs[spirvkey];
+        spirvvec.resize(inputs.size());
+        if (!compile_to_spirv(spirvvec, included_files, inputs, spirvargs, stages))
+            return false;
+
+        if (spirvvec.size() != inputs.size()){
+            print_error("Error in pipeline when compile to SPIRV\n");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool compile_target(const std::vector<spirv_t>& spirvvec, const std::vector<input_t>& inputs, const std::vector<std::set<std::string>>& macros, const args_t& args){
+    std::vector<spirvcross_t> spirvcrossvec;
+    spirvcrossvec.resize(inputs.size());
+    if (!compile_to_lang(spirvcrossvec, spirvvec, inputs, macros, args))
+        return false;
+
+    if (spirvcrossvec.size() != inputs.size()){
+        print_error("Error in pipeline when compile to shader lang\n");
+        return false;
+    }
+
+    if (args.output_type == OUTPUT_JSON){
+        if (!generate_json(spirvcrossvec, inputs, args))
+            return false;
+    }else if (args.output_type == OUTPUT_BINARY){
+        if (!generate_sbs(spirvcrossvec, inputs, args))
+            return false;
+    }
+
+    return true;
+}
+
+static bool compile_back_end(const preamble_spirv_t& spirvs, const std::vector<input_t>& inputs, const std::vector<std::set<std::string>>& macros, const std::vector<args_t>& targetargs){
+    if (targetargs.size() == 1)
+        return compile_target(spirvs.begin()->second, inputs, macros, targetargs[0]);
+
+    // Back-ends are independent, run all targets in parallel
+    std::vector<char> results(targetargs.size(), 0);
+    return run_parallel(results, (int)targetargs.size(), [&](size_t t){
+        return compile_target(spirvs.at(get_spirv_key(targetargs[t])), inputs, macros, targetargs[t]);
+    });
+}
+
+bool supershader::compile_program(const args_t& args){
+    std::set<std::string> included_files;
+    if (!args.variants.empty())
+        return compile_variants(included_files, args) && write_depfile(args, included_files);
+
+    // Built-in symbol tables are kept for all front-ends of program
+    process_reference_t process;
+
+    // Cached programs are compiled to buffers, outputs are written from cache or new results
+    if (!args.cache_dir.empty()){
+        std::vector<target_result_t> results;
+        if (!compile_program_results(results, included_files, args))
+            return false;
+
+        return write_program_results(results, included_files, args);
+    }
+
+    std::vector<input_t> inputs;
+    if (!load_input(inputs, args))
+        return false;
+
+    std::vector<args_t> targetargs = get_target_args(args);
+
+    // Referenced defines of stages, same for all targets
+    std::vector<std::set<std::string>> macros;
+    get_stage_macros(macros, inputs, args);
+
+    preamble_spirv_t spirvs;
+    if (!compile_front_end(spirvs, included_files, inputs, targetargs, args.list_includes))
+        return false;
+
+    if (!compile_back_end(spirvs, inputs, macros, targetargs))
+        return false;
+
+    return write_depfile(args, included_files);
+}
+
+static bool compile_target_result(target_result_t& result, const std::vector<spirv_t>& spirvvec, const std::vector<input_t>& inputs, const std::vector<std::set<std::string>>& macros, const args_t& args){
+    result.inputs = inputs;
+    result.spirvcrossvec.resize(inputs.size());
+    if (!compile_to_lang(result.spirvcrossvec, spirvvec, inputs, macros, args))
+        return false;
+
+    if (result.spirvcrossvec.size() != inputs.size()){
+        print_error("Error in pipeline when compile to shader lang\n");
+        return false;
+    }
+
+    if (!generate_json_buffer(result.json, result.spirvcrossvec, inputs, args))
+        return false;
+
+    return generate_sbs_buffer(result.sbs, result.spirvcrossvec, inputs, args);
+}
+
+bool supershader::compile_program_results(std::vector<target_result_t>& results, std::set<std::string>& included_files, const args_t& request){
+    args_t storage;
+    const args_t& args = resolve_deprecated_args(storage, request);
+
+    process_reference_t process;
+
+    std::vector<input_t> inputs;
+    if (!load_input(inputs, args))
+        return false;
+
+    // Referenced defines of stages, for cache key and all targets
+    std::vector<std::set<std::string>> macros;
+    get_stage_macros(macros, inputs, args);
+
+    std::string cache_key;
+    preamble_preprocessed_t preprocessed;
+    if (!args.cache_dir.empty()){
+        cache_key = get_program_cache_key(preprocessed, inputs, macros, args);
+        if (!cache_key.empty() && load_cached_program(results, cache_key, inputs, args)){
+            for (auto const& [preamble, stages] : preprocessed){
+                included_files.insert(stages.included_files.begin(), stages.included_files.end());
+            }
+            if (args.list_includes){
+                print_info("Included files:\n");
+                for (const std::string& file : included_files){
+                    print_info("%s\n", file.c_str());
+                }
+            }
+            return true;
+        }
+    }
+
+    std::vector<target_t> targets = get_targets(args);
+    std::vector<args_t> targetargs = get_target_args(args);
+
+    preamble_spirv_t spirvs;
+    if (!compile_front_end(spirvs, included_files, inputs, targetargs, args.list_includes, &preprocessed))
+        return false;
+
+    results.resize(targets.size());
+    std::vector<char> done(targets.size(), 0);
+    if (!run_parallel(done, (int)targets.size(), [&](size_t t){
+            results[t].target = targets[t];
+            return compile_target_result(results[t], spirvs.at(get_spirv_key(targetargs[t])), inputs, macros, targetargs[t]);
+        }))
+        return false;
+
+    // Cache is only an optimization, a failed store does not fail the compile
+    if (!cache_key.empty())
+        store_cached_program(results, cache_key, args);
+
+    return true;
+}
+
+bool supershader::write_program_results(const std::vector<target_result_t>& results, const std::set<std::string>& included_files, const args_t& request){
+    args_t storage;
+    const args_t& args = resolve_deprecated_args(storage, request);
+
+    std::vector<args_t> targetargs = get_target_args(args);
+    if (targetargs.size() != results.size()){
+        print_error("Results do not match targets of %s\n", args.output_basename.c_str());
+        return false;
+    }
+
+    for (int t = 0; t < results.size(); t++){
+        const target_result_t& result = results[t];
+        if (targetargs[t].output_type == OUTPUT_JSON){
+            if (!generate_json(result.spirvcrossvec, result.inputs, targetargs[t]))
+                return false;
+        }else if (targetargs[t].output_type == OUTPUT_BINARY){
+            if (!generate_sbs(result.spirvcrossvec, result.inputs, targetargs[t]))
+                return false;
+        }
+    }
+
+    return write_depfile(args, included_files);
+}
+
+std::vector<std::string> supershader::get_output_files(const args_t& args){
+    std::vector<std::string> files;
+
+    if (!args.variants.empty()){
+        files.push_back(args.output_dir + args.output_basename + "_variants.json");
+        return files;
+    }
+
+    for (const args_t& targetargs : get_target_args(args)){
+        if (targetargs.output_type == OUTPUT_JSON){
+            files.push_back(get_json_file(targetargs));
+        }else if (targetargs.output_type == OUTPUT_BINARY){
+            files.push_back(get_sbs_file(targetargs));
+        }
+    }
+
+    return files;
+}
+
+// FNV-1a, only used to find candidates, modules are compared after
+static uint64_t hash_spirv(const preamble_spirv_t& spirvs){
+    uint64_t hash = 14695981039346656037ULL;
+    for (auto const& [preamble, spirvvec] : spirvs){
+        for (const spirv_t& spirv : spirvvec){
+            for (uint32_t word : spirv.bytecode){
+                hash = (hash ^ word) * 1099511628211ULL;
+            }
+            hash = (hash ^ spirv.bytecode.size()) * 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+static bool equal_spirv(const preamble_spirv_t& a, const preamble_spirv_t& b){
+    if (a.size() != b.size())
+        return false;
+
+    for (auto ita = a.begin(), itb = b.begin(); ita != a.end(); ++ita, ++itb){
+        if (ita->first != itb->first || ita->second.size() != itb->second.size())
+            return false;
+        for (size_t i = 0; i < ita->second.size(); i++){
+            if (ita->second[i].bytecode != itb->second[i].bytecode)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+static bool is_variant_excluded(const std::vector<std::string>& enabled, const args_t& args){
+    for (const std::vector<std::string>& exclude : args.variant_excludes){
+        bool all = !exclude.empty();
+        for (const std::string& def : exclude){
+            if (std::find(enabled.begin(), enabled.end(), def) == enabled.end()){
+                all = false;
+                break;
+            }
+        }
+        if (all)
+            return true;
+    }
+
+    return false;
+}
+
+bool supershader::compile_variants(std::set<std::string>& included_files, const args_t& args){
+    if (args.variants.size() > MaxVariantDefines){
+        print_error("Too many variant defines: %i (max %i)\n", (int)args.variants.size(), MaxVariantDefines);
+        return false;
+    }
+
+    process_reference_t process;
+
+    std::vector<input_t> inputs;
+    if (!load_input(inputs, args))
+        return false;
+
+    // Defines never referenced by any stage cannot change a variant, they are not expanded
+    std::vector<std::set<std::string>> stagemacros;
+    get_stage_macros(stagemacros, inputs, args);
+    std::set<std::string> macros;
+    for (const std::set<std::string>& m : stagemacros){
+        macros.insert(m.begin(), m.end());
+    }
+    for (const std::string& def : args.variants){
+        if (macros.find(def) == macros.end())
+            print_info("%s: variant define %s is not used\n", args.output_basename.c_str(), def.c_str());
+    }
+
+    // Expand all combinations of variant defines, each compiles only its used defines
+    std::vector<std::vector<std::string>> variants;
+    std::vector<std::vector<std::string>> compiled;
+    std::vector<size_t> variantcompiled;
+    for (uint32_t mask = 0; mask < (1u << args.variants.size()); mask++){
+        std::vector<std::string> enabled;
+        for (int d = 0; d < args.variants.size(); d++){
+            if (mask & (1u << d))
+                enabled.push_back(args.variants[d]);
+        }
+        if (is_variant_excluded(enabled, args))
+            continue;
+
+        std::vector<std::string> used = get_used_defines(enabled, macros);
+        auto it = std::find(compiled.begin(), compiled.end(), used);
+        variantcompiled.push_back(it - compiled.begin());
+        if (it == compiled.end())
+            compiled.push_back(used);
+        variants.push_back(enabled);
+    }
+
+    std::vector<args_t> variantargs(compiled.size(), args);
+    for (int v = 0; v < compiled.size(); v++){
+        variantargs[v].variants.clear();
+        for (const std::string& def : compiled[v]){
+            variantargs[v].defines.push_back({def, ""});
+            variantargs[v].output_basename += "_" + def;
+        }
+    }
+
+    // Front-end of all variants
+    std::vector<preamble_spirv_t> spirvs(compiled.size());
+    std::vector<std::set<std::string>> variantincludes(compiled.size());
+    std::vector<char> results(compiled.size(), 0);
+    if (!run_parallel(results, args.jobs, [&](size_t v){
+            return compile_front_end(spirvs[v], variantincludes[v], inputs, get_target_args(variantargs[v]), args.list_includes && v == 0);
+        }))
+        return false;
+
+    // A variant define can enable an include
+    for (const std::set<std::string>& includes : variantincludes){
+        included_files.insert(includes.begin(), includes.end());
+    }
+
+    // Variants with same SPIR-V share the same output
+    std::vector<size_t> unique;
+    std::vector<size_t> variantunique(compiled.size());
+    std::multimap<uint64_t, size_t> hashes;
+    for (size_t v = 0; v < compiled.size(); v++){
+        uint64_t hash = hash_spirv(spirvs[v]);
+        bool found = false;
+        auto range = hashes.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it){
+            if (equal_spirv(spirvs[v], spirvs[it->second])){
+                variantunique[v] = variantunique[it->second];
+                found = true;
+                break;
+            }
+        }
+        if (!found){
+            variantunique[v] = unique.size();
+            unique.push_back(v);
+            hashes.insert({hash, v});
+        }
+    }
+
+    // Back-end only for unique modules
+    results.assign(unique.size(), 0);
+    if (!run_parallel(results, args.jobs, [&](size_t u){
+            size_t v = unique[u];
+            return compile_back_end(spirvs[v], inputs, stagemacros, get_target_args(variantargs[v]));
+        }))
+        return false;
+
+    json j;
+    for (size_t v = 0; v < variants.size(); v++){
+        json vj;
+        vj["defines"] = variants[v];
+        vj["output"] = variantargs[unique[variantunique[variantcompiled[v]]]].output_basename;
+
+        j["variants"].push_back(vj);
+    }
+
+    std::string map_path = get_output_files(args)[0];
+    if (!write_output_file(map_path, j.dump(4) + "\n")) {
+        print_error("Writing to file %s failed\n", map_path.c_str());
+        return false;
+    }
+
+    print_info("%s: %i variants, %i compiled, %i unique\n", args.output_basename.c_str(), (int)variants.size(), (int)compiled.size(), (int)unique.size());
+
+    return true;
+}
@@ -0,0 +1,103 @@
+//
+// (c) 2024 Eduardo Doria.
+//
+
+#include "supershader.h"
+
+#include "nlohmann/json.hpp"
+#include <mutex>
+#include <algorithm>
+#include <tuple>
+
+using namespace supershader;
+
+using json = nlohmann::ordered_json;
+
+static const uint32_t SpirvHeaderWords = 5;
+static const uint32_t SpirvOpFunction = 54;
+
+static std::mutex profile_mutex;
+static std::vector<stage_profile_t> profiles;
+
+spirv_stats_t supershader::get_spirv_stats(const std::vector<uint32_t>& spirv){
+    spirv_stats_t stats;
+    stats.words = spirv.size();
+
+    // Each instruction starts with its word count and opcode
+    size_t i = SpirvHeaderWords;
+    while (i < spirv.size()){
+        uint32_t count = spirv[i] >> 16;
+        if (count == 0)
+            break;
+        if ((spirv[i] & 0xFFFF) == SpirvOpFunction)
+            stats.functions++;
+        stats.instructions++;
+        i += count;
+    }
+
+    return stats;
+}
+
+void supershader::add_stage_profile(const stage_profile_t& profile){
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    profiles.push_back(profile);
+}
+
+static json stats_to_json(const spirv_stats_t& stats){
+    json j;
+    j["words"] = stats.words;
+    j["instructions"] = stats.instructions;
+    j["functions"] = stats.functions;
+    return j;
+}
+
+bool supershader::write_pass_profile(const args_t& args){
+    std::vector<stage_profile_t> stages;
+    {
+        std::lock_guard<std::mutex> lock(profile_mutex);
+        stages = profiles;
+    }
+
+    // Compiles run in parallel, report has same order in every run
+    std::sort(stages.begin(), stages.end(), [](const stage_profile_t& a, const stage_profile_t& b){
+        return std::tie(a.program, a.file, a.stage_type, a.optimization, a.defines) < std::tie(b.program, b.file, b.stage_type, b.optimization, b.defines);
+    });
+
+    json j;
+    j["stages"] = json::array();
+    for (const stage_profile_t& stage : stages){
+        json sj;
+        sj["program"] = stage.program;
+        sj["file"] = stage.file;
+        sj["stage"] = (stage.stage_type == STAGE_VERTEX) ? "vs" : "fs";
+        sj["optimization"] = stage.optimization;
+        if (!stage.defines.empty())
+            sj["defines"] = stage.defines;
+
+        double total = 0;
+        sj["passes"] = json::array();
+        for (const pass_profile_t& pass : stage.passes){
+            json pj;
+            pj["name"] = pass.name;
+            pj["time_ms"] = pass.time_ms;
+            pj["before"] = stats_to_json(pass.before);
+            pj["after"] = stats_to_json(pass.after);
+            sj["passes"].push_back(pj);
+            total += pass.time_ms;
+        }
+        sj["time_ms"] = total;
+        if (!stage.passes.empty()){
+            sj["before"] = stats_to_json(stage.passes.front().before);
+            sj["after"] = stats_to_json(stage.passes.back().after);
+        }
+
+        j["stages"].push_back(sj);
+    }
+
+    if (!write_output_file(args.profile_passes, j.dump(4) + "\n")){
+        print_error("Writing to file %s failed\n", args.profile_passes.c_str());
+        return false;
+    }
+
+    return true;
+}
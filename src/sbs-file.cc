@@ -4,14 +4,17 @@
 
 #include "supershader.h"
 
-#include <fstream>
+#include <sstream>
 #include <cstring>
 
 using namespace supershader;
 
 #define makefourcc(_a, _b, _c, _d) (((uint32_t)(_a) | ((uint32_t)(_b) << 8) | ((uint32_t)(_c) << 16) | ((uint32_t)(_d) << 24)))
 
-#define SBS_VERSION 130
+// 140 adds num_spec_constants to sbs_chunk_refl and sbs_refl_specconstant array,
+// files without specialization constants are still written as 130
+#define SBS_VERSION 140
+#define SBS_VERSION_NO_SPEC_CONSTANTS 130
 #define SBS_NAME_SIZE 64
 
 #pragma pack(push, 1)
@@ -51,6 +54,11 @@ using namespace supershader;
 
 #define SBS_STORAGEBUFFERTYPE_STRUCT     makefourcc('S', 'T', 'R', 'C')
 
+#define SBS_SPECCONSTANTTYPE_BOOL     makefourcc('B', 'O', 'O', 'L')
+#define SBS_SPECCONSTANTTYPE_INT      makefourcc('I', 'N', 'T', '1')
+#define SBS_SPECCONSTANTTYPE_UINT     makefourcc('U', 'I', 'N', '1')
+#define SBS_SPECCONSTANTTYPE_FLOAT    makefourcc('F', 'L', 'T', '1')
+
 #define SBS_TEXTURE_2D          makefourcc('2', 'D', ' ', ' ')
 #define SBS_TEXTURE_3D          makefourcc('3', 'D', ' ', ' ')
 #define SBS_TEXTURE_CUBE        makefourcc('C', 'U', 'B', 'E')
@@ -86,6 +94,7 @@ struct sbs_chunk_refl {
     uint32_t num_uniform_blocks;
     uint32_t num_uniforms;
     uint32_t num_storage_buffers;
+    uint32_t num_spec_constants;
 };
 
 struct sbs_refl_input {
@@ -144,6 +153,13 @@ struct sbs_refl_storagebuffer {
     uint32_t type;
 };
 
+struct sbs_refl_specconstant {
+    char     name[SBS_NAME_SIZE];
+    uint32_t constant_id;
+    uint32_t type;
+    uint32_t default_value;
+};
+
 #pragma pack(pop)
 
 static uint32_t get_stage(stage_type_t stage){
@@ -202,6 +218,20 @@ static uint32_t get_storage_buffer_type(storage_buffer_type_t type){
     return 0;
 }
 
+static uint32_t get_spec_constant_type(spec_constant_type_t type){
+    if (type == spec_constant_type_t::BOOL){
+        return SBS_SPECCONSTANTTYPE_BOOL;
+    }else if (type == spec_constant_type_t::INT){
+        return SBS_SPECCONSTANTTYPE_INT;
+    }else if (type == spec_constant_type_t::UINT){
+        return SBS_SPECCONSTANTTYPE_UINT;
+    }else if (type == spec_constant_type_t::FLOAT){
+        return SBS_SPECCONSTANTTYPE_FLOAT;
+    }
+
+    return 0;
+}
+
 static uint32_t get_vertex_type(attribute_type_t type){
     if (type == attribute_type_t::FLOAT){
         return SBS_VERTEXTYPE_FLOAT;
@@ -268,15 +298,7 @@ static void copy_name(char* dest, const std::string& source){
     dest[n] = '\0';
 }
 
-bool supershader::generate_sbs(const std::vector<spirvcross_t>& spirvcrossvec, const std::vector<input_t>& inputs, const args_t& args){
-
-    std::string filename = args.output_dir + args.output_basename + ".sbs";
-
-    std::ofstream ofs(filename, std::ios::out | std::ios::binary);
-    if(!ofs) {
-        fprintf(stderr, "Cannot open file %s\n", filename.c_str());
-        return false;
-    }
+static void write_sbs(std::ostream& ofs, const std::vector<spirvcross_t>& spirvcrossvec, const args_t& args){
 
     const uint32_t _sbs = SBS_CHUNK;
     const uint32_t _sbs_size = 0;
@@ -284,8 +306,15 @@ bool supershader::generate_sbs(const std::vector<spirvcross_t>& spirvcrossvec, c
     ofs.write((char *) &_sbs, sizeof(uint32_t));
     ofs.write((char *) &_sbs_size, sizeof(uint32_t));
 
+    bool has_spec_constants = false;
+    for (const spirvcross_t& spirvcross : spirvcrossvec){
+        has_spec_constants = has_spec_constants || !spirvcross.spec_constants.empty();
+    }
+    // Last field of reflection header is only written by version 140
+    const uint32_t refl_header_size = sizeof(sbs_chunk_refl) - (has_spec_constants ? 0 : sizeof(uint32_t));
+
     sbs_chunk sbs;
-    sbs.sbs_version = SBS_VERSION;
+    sbs.sbs_version = has_spec_constants ? SBS_VERSION : SBS_VERSION_NO_SPEC_CONSTANTS;
     sbs.lang = get_lang(args.lang);
     sbs.version = args.version;
     sbs.es = args.es;
@@ -302,18 +331,20 @@ bool supershader::generate_sbs(const std::vector<spirvcross_t>& spirvcrossvec, c
         size_t num_samplers = spirvcrossvec[i].samplers.size();
         size_t num_texture_sampler_pairs = spirvcrossvec[i].texture_sampler_pairs.size();
         size_t num_sb = spirvcrossvec[i].storage_buffers.size();
+        size_t num_sc = spirvcrossvec[i].spec_constants.size();
 
         const uint32_t code_size = spirvcrossvec[i].source.size();
 
         const uint32_t refl_size = 
-            sizeof(sbs_chunk_refl) + 
+            refl_header_size + 
             sizeof(sbs_refl_input) * num_inputs +
             sizeof(sbs_refl_texture) * num_textures +
             sizeof(sbs_refl_sampler) * num_samplers +
             sizeof(sbs_refl_texture_sampler_pair) * num_texture_sampler_pairs +
             sizeof(sbs_refl_uniformblock) * num_ubs +
             sizeof(sbs_refl_uniform) * num_us +
-            sizeof(sbs_refl_storagebuffer) * num_sb;
+            sizeof(sbs_refl_storagebuffer) * num_sb +
+            sizeof(sbs_refl_specconstant) * num_sc;
 
         const uint32_t stage_size = 
             sizeof(sbs_stage) +
@@ -346,8 +377,9 @@ bool supershader::generate_sbs(const std::vector<spirvcross_t>& spirvcrossvec, c
         refl.num_uniform_blocks = num_ubs;
         refl.num_uniforms = num_us;
         refl.num_storage_buffers = num_sb;
+        refl.num_spec_constants = num_sc;
 
-        ofs.write((char *) &refl, sizeof(sbs_chunk_refl));
+        ofs.write((char *) &refl, refl_header_size);
 
         for (int a = 0; a < num_inputs; a++){
             sbs_refl_input refl_input;
@@ -425,13 +457,45 @@ bool supershader::generate_sbs(const std::vector<spirvcross_t>& spirvcrossvec, c
 
             ofs.write((char *) &refl_storagebuffer, sizeof(sbs_refl_storagebuffer));
         }
+
+        for (int a = 0; a < num_sc; a++){
+            sbs_refl_specconstant refl_specconstant;
+            copy_name(refl_specconstant.name, spirvcrossvec[i].spec_constants[a].name);
+            refl_specconstant.constant_id = spirvcrossvec[i].spec_constants[a].constant_id;
+            refl_specconstant.type = get_spec_constant_type(spirvcrossvec[i].spec_constants[a].type);
+            refl_specconstant.default_value = spirvcrossvec[i].spec_constants[a].default_value;
+
+            ofs.write((char *) &refl_specconstant, sizeof(sbs_refl_specconstant));
+        }
     }
+}
+
+std::string supershader::get_sbs_file(const args_t& args){
+    return args.output_dir + args.output_basename + ".sbs";
+}
+
+bool supershader::generate_sbs(const std::vector<spirvcross_t>& spirvcrossvec, const std::vector<input_t>& inputs, const args_t& args){
 
-    ofs.close();
-    if(!ofs.good()) {
-        fprintf(stderr, "Writing to file %s failed\n", filename.c_str());
+    std::string filename = get_sbs_file(args);
+
+    std::ostringstream oss(std::ios::out | std::ios::binary);
+    write_sbs(oss, spirvcrossvec, args);
+
+    if(!write_output_file(filename, oss.str())) {
+        print_error("Writing to file %s failed\n", filename.c_str());
         return false;
     }
 
+    return true;
+}
+
+bool supershader::generate_sbs_buffer(std::vector<char>& buffer, const std::vector<spirvcross_t>& spirvcrossvec, const std::vector<input_t>& inputs, const args_t& args){
+    std::ostringstream oss(std::ios::out | std::ios::binary);
+
+    write_sbs(oss, spirvcrossvec, args);
+
+    const std::string data = oss.str();
+    buffer.assign(data.begin(), data.end());
+
     return true;
 }
\ No newline at end of file
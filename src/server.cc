@@ -0,0 +1,199 @@
+//
+// (c) 2024 Eduardo Doria.
+//
+
+#include "supershader.h"
+
+#include "nlohmann/json.hpp"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <signal.h>
+#endif
+
+using namespace supershader;
+
+using json = nlohmann::ordered_json;
+
+static json get_request_id(const std::string& line){
+    json request = json::parse(line, nullptr, false);
+    if (!request.is_discarded() && request.is_object() && request.contains("id"))
+        return request["id"];
+
+    return nullptr;
+}
+
+static json get_response(Compiler& compiler, const std::string& line, const args_t& args){
+    json response;
+
+    json id = get_request_id(line);
+    if (!id.is_null())
+        response["id"] = id;
+
+    compile_result_t result;
+
+    // Request errors also go to response diagnostics
+    args_t requestargs;
+    set_output_capture(&result.diagnostics);
+    bool valid = load_request(requestargs, line, args);
+    set_output_capture(nullptr);
+
+    if (valid){
+        std::string diagnostics = result.diagnostics;
+        result = compiler.compile(requestargs);
+        result.diagnostics = diagnostics + result.diagnostics;
+    }
+
+    response["success"] = valid && result.success;
+    response["diagnostics"] = result.diagnostics;
+    if (valid && result.success){
+        response["targets"] = json::array();
+        for (const target_result_t& target : result.targets){
+            json tj;
+            tj["target"] = target.target.name;
+            json reflection = json::parse(target.json);
+            for (auto& [key, value] : reflection.items()){
+                tj[key] = value;
+            }
+            response["targets"].push_back(tj);
+        }
+    }
+
+    return response;
+}
+
+// A bad request fails alone, it never stops the server
+static std::string handle_request(Compiler& compiler, const std::string& line, const args_t& args){
+    json response;
+    try{
+        response = get_response(compiler, line, args);
+    }catch (const std::exception& e){
+        response = json();
+        json id = get_request_id(line);
+        if (!id.is_null())
+            response["id"] = id;
+        response["success"] = false;
+        response["diagnostics"] = std::string("Request failed: ") + e.what() + "\n";
+    }
+
+    // Diagnostics and echoed paths can have invalid UTF-8
+    return response.dump(-1, ' ', false, json::error_handler_t::replace) + "\n";
+}
+
+static bool serve_stdin(Compiler& compiler, const args_t& args){
+    std::string line;
+    while (std::getline(std::cin, line)){
+        if (line.empty())
+            continue;
+
+        std::string response = handle_request(compiler, line, args);
+        fwrite(response.data(), 1, response.size(), stdout);
+        fflush(stdout);
+    }
+
+    return true;
+}
+
+#ifndef _WIN32
+
+static bool write_all(int fd, const std::string& data){
+    size_t written = 0;
+    while (written < data.size()){
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n <= 0)
+            return false;
+        written += n;
+    }
+    return true;
+}
+
+static void serve_connection(Compiler& compiler, int fd, const args_t& args){
+    std::string buffer;
+    char chunk[4096];
+
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0){
+        buffer.append(chunk, n);
+
+        size_t end;
+        while ((end = buffer.find('\n')) != std::string::npos){
+            std::string line = buffer.substr(0, end);
+            buffer.erase(0, end + 1);
+            if (line.empty())
+                continue;
+
+            if (!write_all(fd, handle_request(compiler, line, args)))
+                return;
+        }
+    }
+}
+
+static bool serve_socket(Compiler& compiler, const args_t& args){
+    // Clients can disconnect before response is written
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (args.server_socket.size() >= sizeof(addr.sun_path)){
+        fprintf(stderr, "Socket path is too long: %s\n", args.server_socket.c_str());
+        return false;
+    }
+    strncpy(addr.sun_path, args.server_socket.c_str(), sizeof(addr.sun_path) - 1);
+
+    int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_fd < 0){
+        fprintf(stderr, "Unable to create socket: %s\n", strerror(errno));
+        return false;
+    }
+
+    unlink(args.server_socket.c_str());
+    if (bind(server_fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(server_fd, 16) < 0){
+        fprintf(stderr, "Unable to listen on socket %s: %s\n", args.server_socket.c_str(), strerror(errno));
+        close(server_fd);
+        return false;
+    }
+
+    fprintf(stdout, "Listening on %s\n", args.server_socket.c_str());
+    fflush(stdout);
+
+    while (true){
+        int fd = accept(server_fd, nullptr, nullptr);
+        if (fd < 0){
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Unable to accept connection: %s\n", strerror(errno));
+            break;
+        }
+
+        serve_connection(compiler, fd, args);
+        close(fd);
+    }
+
+    close(server_fd);
+    unlink(args.server_socket.c_str());
+
+    return false;
+}
+
+#endif
+
+bool supershader::run_server(const args_t& args){
+    // glslang state is kept warm for all requests
+    Compiler compiler;
+
+    if (args.server_socket.empty())
+        return serve_stdin(compiler, args);
+
+#ifndef _WIN32
+    return serve_socket(compiler, args);
+#else
+    fprintf(stderr, "Unix socket server is not supported on Windows, use stdin\n");
+    return false;
+#endif
+}
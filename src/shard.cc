@@ -0,0 +1,212 @@
+//
+// (c) 2024 Eduardo Doria.
+//
+
+#include "supershader.h"
+
+#include "nlohmann/json.hpp"
+#include <fstream>
+#include <map>
+#include <set>
+#include <algorithm>
+
+using namespace supershader;
+
+using json = nlohmann::ordered_json;
+
+// FNV-1a of program name, must not change between versions or machines
+static uint64_t hash_program_key(const std::string& key){
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : key){
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static bool load_index(json& index, const std::string& path){
+    std::ifstream ifs(path);
+    if (!ifs){
+        print_error("Unable to open batch index: %s\n", path.c_str());
+        return false;
+    }
+
+    index = json::parse(ifs, nullptr, false);
+    if (index.is_discarded() || !index.is_object() || !index.contains("programs") || !index["programs"].is_array()){
+        print_error("Invalid batch index: %s\n", path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// Indices are read by other machines and as costs of next build, never left partial
+static bool write_index(const json& index, const std::string& path){
+    if (!write_output_file(path, index.dump(4) + "\n")) {
+        print_error("Writing to file %s failed\n", path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+static std::string shard_to_string(int shard, int shard_count){
+    return std::to_string(shard) + "/" + std::to_string(shard_count);
+}
+
+bool supershader::select_shard(std::vector<args_t>& programs, const args_t& args){
+    std::vector<int> shards(programs.size(), 0);
+
+    if (args.shard_costs.empty()){
+        // Without costs each program goes to the shard of its hash, adding programs does not move others
+        for (size_t i = 0; i < programs.size(); i++){
+            shards[i] = (int)(hash_program_key(programs[i].program_name) % args.shard_count);
+        }
+    }else{
+        json index;
+        if (!load_index(index, args.shard_costs))
+            return false;
+
+        std::map<std::string, double> recorded;
+        for (const json& pj : index["programs"]){
+            if (pj.contains("name") && pj.contains("time") && pj["time"].is_number())
+                recorded[pj["name"].get<std::string>()] = pj["time"].get<double>();
+        }
+
+        // Programs never compiled before are expected to cost the average
+        double average = 1.0;
+        if (!recorded.empty()){
+            average = 0.0;
+            for (auto const& [name, time] : recorded){
+                average += time;
+            }
+            average /= recorded.size();
+        }
+
+        std::vector<double> costs(programs.size());
+        std::vector<size_t> order(programs.size());
+        for (size_t i = 0; i < programs.size(); i++){
+            auto it = recorded.find(programs[i].program_name);
+            costs[i] = (it != recorded.end()) ? it->second : average;
+            order[i] = i;
+        }
+
+        // Longest first to the least loaded shard, ties are broken by key so all machines agree
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b){
+            if (costs[a] != costs[b])
+                return costs[a] > costs[b];
+            if (programs[a].program_name != programs[b].program_name)
+                return programs[a].program_name < programs[b].program_name;
+            return a < b;
+        });
+
+        std::vector<double> loads(args.shard_count, 0.0);
+        for (size_t i : order){
+            int shard = (int)(std::min_element(loads.begin(), loads.end()) - loads.begin());
+            shards[i] = shard;
+            loads[shard] += costs[i];
+        }
+    }
+
+    std::vector<args_t> selected;
+    for (size_t i = 0; i < programs.size(); i++){
+        if (shards[i] == args.shard)
+            selected.push_back(programs[i]);
+    }
+
+    fprintf(stdout, "Shard %s: %i of %i programs\n", shard_to_string(args.shard, args.shard_count).c_str(), (int)selected.size(), (int)programs.size());
+
+    programs = selected;
+
+    return true;
+}
+
+bool supershader::write_batch_index(const std::vector<args_t>& programs, const std::vector<char>& results, const std::vector<double>& times, const args_t& args){
+    json index;
+    if (args.shard_count > 0)
+        index["shard"] = shard_to_string(args.shard, args.shard_count);
+
+    index["programs"] = json::array();
+    for (size_t i = 0; i < programs.size(); i++){
+        json pj;
+        pj["name"] = programs[i].program_name;
+        pj["success"] = results[i] ? true : false;
+        pj["time"] = times[i];
+        pj["outputs"] = get_output_files(programs[i]);
+
+        index["programs"].push_back(pj);
+    }
+
+    return write_index(index, args.index_file);
+}
+
+bool supershader::merge_batch_indices(const args_t& args){
+    json merged;
+    merged["programs"] = json::array();
+
+    std::map<std::string, json> programs;
+    std::set<std::string> shards;
+    int shard_count = 0;
+    bool success = true;
+
+    for (const std::string& path : args.merge_inputs){
+        json index;
+        if (!load_index(index, path))
+            return false;
+
+        if (index.contains("shard")){
+            std::string shard = index.value("shard", "");
+            int count = atoi(shard.substr(shard.find('/') + 1).c_str());
+            if (shard_count != 0 && count != shard_count){
+                print_error("Batch index %s is shard %s, other indices have %i shards\n", path.c_str(), shard.c_str(), shard_count);
+                return false;
+            }
+            if (!shards.insert(shard).second){
+                print_error("Shard %s is in more than one batch index\n", shard.c_str());
+                return false;
+            }
+            shard_count = count;
+        }
+
+        for (const json& pj : index["programs"]){
+            std::string name = pj.value("name", "");
+            if (programs.find(name) != programs.end()){
+                print_error("Program '%s' is in more than one batch index\n", name.c_str());
+                return false;
+            }
+
+            if (!pj.value("success", false)){
+                print_error("Program '%s' failed in %s\n", name.c_str(), path.c_str());
+                success = false;
+            }
+
+            if (pj.contains("outputs")){
+                for (const json& output : pj["outputs"]){
+                    std::ifstream ifs(output.get<std::string>());
+                    if (!ifs){
+                        print_error("Program '%s': missing output %s\n", name.c_str(), output.get<std::string>().c_str());
+                        success = false;
+                    }
+                }
+            }
+
+            programs[name] = pj;
+        }
+    }
+
+    if (shard_count > 0 && (int)shards.size() != shard_count){
+        print_error("Missing shards, merged %i of %i\n", (int)shards.size(), shard_count);
+        success = false;
+    }
+
+    // Sorted by name, result does not depend on shard order
+    for (auto const& [name, pj] : programs){
+        merged["programs"].push_back(pj);
+    }
+
+    if (!write_index(merged, args.merge_file))
+        return false;
+
+    fprintf(stdout, "Merged %i programs from %i batch indices\n", (int)programs.size(), (int)args.merge_inputs.size());
+
+    return success;
+}
@@ -0,0 +1,219 @@
+//
+// (c) 2024 Eduardo Doria.
+//
+
+#include "supershader.h"
+
+#include <map>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include "SPIRV/spirv.hpp"
+
+using namespace supershader;
+
+static const uint32_t SpirvHeaderWords = 5;
+
+struct spec_type_t{
+    spv::Op op = spv::OpNop;
+    uint32_t width = 0;
+    bool is_signed = false;
+};
+
+static bool is_number(const std::string& str){
+    if (str.empty())
+        return false;
+    for (char c : str){
+        if (c < '0' || c > '9')
+            return false;
+    }
+    return true;
+}
+
+// Constant ids are 32 bits, larger numbers are not valid
+static bool get_constant_id(uint32_t& id, const std::string& str){
+    errno = 0;
+    char* end = nullptr;
+    unsigned long long value = strtoull(str.c_str(), &end, 10);
+    if (errno != 0 || *end != '\0' || value > UINT32_MAX)
+        return false;
+    id = (uint32_t)value;
+    return true;
+}
+
+static std::string get_literal_string(const std::vector<uint32_t>& spirv, size_t start, size_t end){
+    std::string str;
+    for (size_t w = start; w < end; w++){
+        for (int b = 0; b < 4; b++){
+            char c = (char)((spirv[w] >> (b * 8)) & 0xFF);
+            if (c == 0)
+                return str;
+            str += c;
+        }
+    }
+    return str;
+}
+
+// Words of value in SPIR-V literal order, low bits first
+static bool get_value_words(std::vector<uint32_t>& words, const spec_type_t& type, const std::string& value){
+    const char* str = value.c_str();
+    char* end = nullptr;
+    errno = 0;
+
+    uint64_t bits = 0;
+    if (type.op == spv::OpTypeFloat){
+        if (type.width == 32){
+            float f = strtof(str, &end);
+            uint32_t b32;
+            memcpy(&b32, &f, sizeof(b32));
+            bits = b32;
+        }else{
+            double d = strtod(str, &end);
+            memcpy(&bits, &d, sizeof(bits));
+        }
+    }else if (type.is_signed){
+        int64_t i = strtoll(str, &end, 0);
+        if (type.width == 32 && (i < INT32_MIN || i > INT32_MAX))
+            return false;
+        bits = (uint64_t)i;
+        if (type.width == 32)
+            bits &= 0xFFFFFFFF;
+    }else{
+        if (value[0] == '-')
+            return false;
+        uint64_t u = strtoull(str, &end, 0);
+        if (type.width == 32 && u > UINT32_MAX)
+            return false;
+        bits = u;
+    }
+    if (errno != 0 || end == str || *end != '\0')
+        return false;
+
+    words.clear();
+    words.push_back((uint32_t)(bits & 0xFFFFFFFF));
+    if (type.width == 64)
+        words.push_back((uint32_t)(bits >> 32));
+
+    return true;
+}
+
+static bool get_bool_value(bool& result, const std::string& value){
+    if (value == "true" || value == "1"){
+        result = true;
+    }else if (value == "false" || value == "0"){
+        result = false;
+    }else{
+        return false;
+    }
+    return true;
+}
+
+// Constants of args found in this stage are set in matched
+bool supershader::specialize_spirv(spirv_t& spirv, std::vector<char>& matched, const args_t& args){
+    if (args.spec_constants.empty())
+        return true;
+
+    std::vector<uint32_t>& code = spirv.bytecode;
+
+    std::map<uint32_t, std::string> names;
+    std::map<uint32_t, uint32_t> spec_ids;
+    std::map<uint32_t, spec_type_t> types;
+
+    // Names, constant ids and types are declared before constants
+    for (size_t i = SpirvHeaderWords; i < code.size(); i += (code[i] >> 16)){
+        uint32_t count = code[i] >> 16;
+        if (count == 0 || i + count > code.size()){
+            print_error("Invalid SPIR-V in specialization\n");
+            return false;
+        }
+        spv::Op op = (spv::Op)(code[i] & 0xFFFF);
+
+        if (op == spv::OpName && count > 2){
+            names[code[i+1]] = get_literal_string(code, i + 2, i + count);
+        }else if (op == spv::OpDecorate && count > 3 && code[i+2] == spv::DecorationSpecId){
+            spec_ids[code[i+1]] = code[i+3];
+        }else if (op == spv::OpTypeBool && count > 1){
+            types[code[i+1]] = {op, 0, false};
+        }else if ((op == spv::OpTypeInt && count > 3) || (op == spv::OpTypeFloat && count > 2)){
+            types[code[i+1]] = {op, code[i+2], op == spv::OpTypeInt && code[i+3] != 0};
+        }
+    }
+
+    // Ids of numeric names
+    std::vector<uint32_t> sc_ids(args.spec_constants.size(), 0);
+    for (size_t s = 0; s < args.spec_constants.size(); s++){
+        const std::string& def = args.spec_constants[s].def;
+        if (is_number(def) && !get_constant_id(sc_ids[s], def)){
+            print_error("Invalid specialization constant: %s\n", def.c_str());
+            return false;
+        }
+    }
+
+    // Value of each specialized result id
+    std::map<uint32_t, std::string> values;
+    for (const auto& [id, constant_id] : spec_ids){
+        auto name = names.find(id);
+        for (size_t s = 0; s < args.spec_constants.size(); s++){
+            const define_t& sc = args.spec_constants[s];
+            if ((is_number(sc.def) && sc_ids[s] == constant_id) || (name != names.end() && name->second == sc.def)){
+                values[id] = sc.value;
+                matched[s] = 1;
+            }
+        }
+    }
+
+    // Constants not in this stage can be used by the other
+    if (values.empty())
+        return true;
+
+    std::vector<uint32_t> result(code.begin(), code.begin() + SpirvHeaderWords);
+    result.reserve(code.size());
+
+    for (size_t i = SpirvHeaderWords; i < code.size(); i += (code[i] >> 16)){
+        uint32_t count = code[i] >> 16;
+        spv::Op op = (spv::Op)(code[i] & 0xFFFF);
+
+        // SpecId is not allowed on constants
+        if (op == spv::OpDecorate && count > 3 && code[i+2] == spv::DecorationSpecId && values.count(code[i+1]))
+            continue;
+
+        bool is_spec = (op == spv::OpSpecConstantTrue || op == spv::OpSpecConstantFalse || op == spv::OpSpecConstant);
+        auto value = is_spec && count > 2 ? values.find(code[i+2]) : values.end();
+        if (value == values.end()){
+            result.insert(result.end(), code.begin() + i, code.begin() + i + count);
+            continue;
+        }
+
+        uint32_t type_id = code[i+1];
+        uint32_t result_id = code[i+2];
+        const std::string& name = names.count(result_id) ? names[result_id] : std::to_string(spec_ids[result_id]);
+        spec_type_t type = types.count(type_id) ? types[type_id] : spec_type_t();
+
+        if (op == spv::OpSpecConstant){
+            std::vector<uint32_t> words;
+            if ((type.width != 32 && type.width != 64) || !get_value_words(words, type, value->second)){
+                print_error("Invalid value of specialization constant %s: %s\n", name.c_str(), value->second.c_str());
+                return false;
+            }
+            result.push_back(((3 + (uint32_t)words.size()) << 16) | spv::OpConstant);
+            result.push_back(type_id);
+            result.push_back(result_id);
+            result.insert(result.end(), words.begin(), words.end());
+        }else{
+            bool b;
+            if (!get_bool_value(b, value->second)){
+                print_error("Invalid value of specialization constant %s: %s\n", name.c_str(), value->second.c_str());
+                return false;
+            }
+            result.push_back((3 << 16) | (b ? spv::OpConstantTrue : spv::OpConstantFalse));
+            result.push_back(type_id);
+            result.push_back(result_id);
+        }
+    }
+
+    code.swap(result);
+
+    return true;
+}
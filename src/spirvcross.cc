@@ -89,6 +89,20 @@ static uniform_type_t spirtype_to_uniform_type(const spirv_cross::SPIRType& type
     return uniform_type_t::INVALID;
 }
 
+static spec_constant_type_t spirtype_to_spec_constant_type(const spirv_cross::SPIRType& type) {
+    if (type.vecsize == 1 && type.columns == 1) {
+        switch (type.basetype) {
+            case spirv_cross::SPIRType::Boolean: return spec_constant_type_t::BOOL;
+            case spirv_cross::SPIRType::Int:     return spec_constant_type_t::INT;
+            case spirv_cross::SPIRType::UInt:    return spec_constant_type_t::UINT;
+            case spirv_cross::SPIRType::Float:   return spec_constant_type_t::FLOAT;
+            default: break;
+        }
+    }
+
+    return spec_constant_type_t::INVALID;
+}
+
 static texture_type_t spirtype_to_image_type(const spirv_cross::SPIRType& type) {
     if (type.image.arrayed) {
         if (type.image.dim == spv::Dim2D) {
@@ -183,23 +197,23 @@ static bool validate_uniform_blocks_and_separate_image_samplers(const spirv_cros
         for (int m_index = 0; m_index < (int)ub_type.member_types.size(); m_index++) {
             const spirv_cross::SPIRType& m_type = compiler->get_type(ub_type.member_types[m_index]);
             if ((m_type.basetype != spirv_cross::SPIRType::Float) && (m_type.basetype != spirv_cross::SPIRType::Int)) {
-                fprintf(stderr, "%s: uniform block '%s': uniform blocks can only contain float or int base types\n", input.filename.c_str(), ub_res.name.c_str());
+                print_error("%s: uniform block '%s': uniform blocks can only contain float or int base types\n", input.filename.c_str(), ub_res.name.c_str());
                 return false;
             }
             if (m_type.array.size() > 0) {
                 if (m_type.vecsize != 4) {
-                    fprintf(stderr, "%s: uniform block '%s': arrays must be of type vec4[], ivec4[] or mat4[]\n", input.filename.c_str(), ub_res.name.c_str());
+                    print_error("%s: uniform block '%s': arrays must be of type vec4[], ivec4[] or mat4[]\n", input.filename.c_str(), ub_res.name.c_str());
                     return false;
                 }
                 if (m_type.array.size() > 1) {
-                    fprintf(stderr, "%s: uniform block '%s': arrays must be 1-dimensional\n", input.filename.c_str(), ub_res.name.c_str());
+                    print_error("%s: uniform block '%s': arrays must be 1-dimensional\n", input.filename.c_str(), ub_res.name.c_str());
                     return false;
                 }
             }
         }
     }
     if (res.sampled_images.size() > 0) {
-        fprintf(stderr, "%s: combined image sampler '%s' detected, please use separate textures and samplers\n", input.filename.c_str(), res.sampled_images[0].name.c_str());
+        print_error("%s: combined image sampler '%s' detected, please use separate textures and samplers\n", input.filename.c_str(), res.sampled_images[0].name.c_str());
         return false;
     }
     return true;
@@ -300,7 +314,7 @@ static bool parse_stage_reflection(spirvcross_t& spirvcross, const spirv_cross::
     switch (compiler->get_execution_model()) {
         case spv::ExecutionModelVertex:   spirvcross.stage_type = STAGE_VERTEX; break;
         case spv::ExecutionModelFragment: spirvcross.stage_type = STAGE_FRAGMENT; break;
-        default: fprintf(stderr, "INVALID Stage\n"); return false; break;
+        default: print_error("INVALID Stage\n"); return false; break;
     }
 
     // Entry function
@@ -379,7 +393,7 @@ static bool parse_stage_reflection(spirvcross_t& spirvcross, const spirv_cross::
 
         const spirv_cross::SPIRType& struct_type = compiler->get_type(sbuf_res.base_type_id);
         if (struct_type.basetype != spirv_cross::SPIRType::Struct) {
-            fprintf(stderr, "toplevel item %s is not a struct\n", sbuf_res.name.c_str());
+            print_error("toplevel item %s is not a struct\n", sbuf_res.name.c_str());
             return false;
         }
 
@@ -443,6 +457,21 @@ static bool parse_stage_reflection(spirvcross_t& spirvcross, const spirv_cross::
         spirvcross.texture_sampler_pairs.push_back(img_smp);
     }
 
+    // specialization constants, baked ones are already constants
+    for (const spirv_cross::SpecializationConstant& spec: compiler->get_specialization_constants()) {
+        s_spec_constant_t sc;
+
+        const spirv_cross::SPIRConstant& constant = compiler->get_constant(spec.id);
+        const spirv_cross::SPIRType& type = compiler->get_type(constant.constant_type);
+
+        sc.name = compiler->get_name(spec.id);
+        sc.constant_id = spec.constant_id;
+        sc.type = spirtype_to_spec_constant_type(type);
+        sc.default_value = constant.scalar();
+
+        spirvcross.spec_constants.push_back(sc);
+    }
+
     return true;
 }
 
@@ -483,6 +512,10 @@ bool validate_inputs_and_outputs(std::vector<spirvcross_t>& spirvcrossvec, const
             fsIndex = s;
     }
 
+    // Nothing to match when only one stage is compiled
+    if (vsIndex < 0 || fsIndex < 0)
+        return true;
+
     for (int o = 0; o < spirvcrossvec[vsIndex].outputs.size(); o++){
         bool found = false;
         supershader::s_attr_t output = spirvcrossvec[vsIndex].outputs[o];
@@ -494,7 +527,7 @@ bool validate_inputs_and_outputs(std::vector<spirvcross_t>& spirvcrossvec, const
         }
 
         if (!found){
-            fprintf(stderr, "%s, %s: vertex shader output '%s' does not exist in fragment shader inputs\n", inputs[vsIndex].filename.c_str(), inputs[fsIndex].filename.c_str(), output.name.c_str());
+            print_error("%s, %s: vertex shader output '%s' does not exist in fragment shader inputs\n", inputs[vsIndex].filename.c_str(), inputs[fsIndex].filename.c_str(), output.name.c_str());
             return false;
         }
     }
@@ -510,7 +543,7 @@ bool validate_inputs_and_outputs(std::vector<spirvcross_t>& spirvcrossvec, const
         }
 
         if (!found){
-            fprintf(stderr, "%s, %s: fragment shader input '%s' does not exist in vertex shader outputs\n", inputs[vsIndex].filename.c_str(), inputs[fsIndex].filename.c_str(), input.name.c_str());
+            print_error("%s, %s: fragment shader input '%s' does not exist in vertex shader outputs\n", inputs[vsIndex].filename.c_str(), inputs[fsIndex].filename.c_str(), input.name.c_str());
             return false;
         }
     }
@@ -518,103 +551,149 @@ bool validate_inputs_and_outputs(std::vector<spirvcross_t>& spirvcrossvec, const
     return true;
 }
 
-bool supershader::compile_to_lang(std::vector<spirvcross_t>& spirvcrossvec, const std::vector<spirv_t>& spirvvec, const std::vector<input_t>& inputs, const args_t& args){
-    for (int i = 0; i < inputs.size(); i++){
-        spirv_cross::Parser spirv_parser(std::move(spirvvec[i].bytecode));
-	    spirv_parser.parse();
-
-        std::unique_ptr<spirv_cross::CompilerGLSL> compiler;
-        // Use spirv-cross to convert to other types of shader
-        if (args.lang == LANG_GLSL) {
-            compiler.reset(new spirv_cross::CompilerGLSL(std::move(spirv_parser.get_parsed_ir())));
-        } else if (args.lang == LANG_MSL) {
-            compiler.reset(new spirv_cross::CompilerMSL(std::move(spirv_parser.get_parsed_ir())));
-        } else if (args.lang == LANG_HLSL) {
-            compiler.reset(new spirv_cross::CompilerHLSL(std::move(spirv_parser.get_parsed_ir())));
-        } else {
-            fprintf(stderr, "Language not implemented");
-            return false;
-        }
+static bool compile_stage_to_lang(spirvcross_t& spirvcross, const spirv_t& spirv, const input_t& input, const args_t& args){
+    spirv_cross::Parser spirv_parser(std::move(spirv.bytecode));
+    spirv_parser.parse();
+
+    std::unique_ptr<spirv_cross::CompilerGLSL> compiler;
+    // Use spirv-cross to convert to other types of shader
+    if (args.lang == LANG_GLSL) {
+        compiler.reset(new spirv_cross::CompilerGLSL(std::move(spirv_parser.get_parsed_ir())));
+    } else if (args.lang == LANG_MSL) {
+        compiler.reset(new spirv_cross::CompilerMSL(std::move(spirv_parser.get_parsed_ir())));
+    } else if (args.lang == LANG_HLSL) {
+        compiler.reset(new spirv_cross::CompilerHLSL(std::move(spirv_parser.get_parsed_ir())));
+    } else {
+        print_error("Language not implemented");
+        return false;
+    }
 
-        spirv_cross::CompilerGLSL::Options opts = compiler->get_common_options();
-        
-        opts.flatten_multidimensional_arrays = true;
-        opts.vertex.flip_vert_y = false;
+    spirv_cross::CompilerGLSL::Options opts = compiler->get_common_options();
+    
+    opts.flatten_multidimensional_arrays = true;
+    opts.vertex.flip_vert_y = false;
 
-        if (args.lang == LANG_GLSL) {
+    if (args.lang == LANG_GLSL) {
 
-            opts.vulkan_semantics = false; //TODO: True if vulkan
-            opts.emit_line_directives = false;
-            opts.vertex.fixup_clipspace = false;
-            opts.enable_420pack_extension = false;
-            opts.emit_uniform_buffer_as_plain_uniforms = true;  //TODO: False if vulkan
-            opts.es = args.es;
-            opts.version = args.version;
+        opts.vulkan_semantics = false; //TODO: True if vulkan
+        opts.emit_line_directives = false;
+        opts.vertex.fixup_clipspace = false;
+        opts.enable_420pack_extension = false;
+        opts.emit_uniform_buffer_as_plain_uniforms = true;  //TODO: False if vulkan
+        opts.es = args.es;
+        opts.version = args.version;
 
-        } else if (args.lang == LANG_HLSL) {
+    } else if (args.lang == LANG_HLSL) {
 
-            opts.emit_line_directives = true;
-            opts.vertex.fixup_clipspace = true;
+        opts.emit_line_directives = true;
+        opts.vertex.fixup_clipspace = true;
 
-            spirv_cross::CompilerHLSL* hlsl = (spirv_cross::CompilerHLSL*)compiler.get();
-            spirv_cross::CompilerHLSL::Options hlsl_opts = hlsl->get_hlsl_options();
-            hlsl_opts.shader_model = args.version;
-            hlsl_opts.point_size_compat = true;
-            hlsl_opts.point_coord_compat = true;
+        spirv_cross::CompilerHLSL* hlsl = (spirv_cross::CompilerHLSL*)compiler.get();
+        spirv_cross::CompilerHLSL::Options hlsl_opts = hlsl->get_hlsl_options();
+        hlsl_opts.shader_model = args.version;
+        hlsl_opts.point_size_compat = true;
+        hlsl_opts.point_coord_compat = true;
 
-            hlsl->set_hlsl_options(hlsl_opts);
+        hlsl->set_hlsl_options(hlsl_opts);
 
-        } else if (args.lang == LANG_MSL) {
+    } else if (args.lang == LANG_MSL) {
 
-            opts.emit_line_directives = true;
-            opts.vertex.fixup_clipspace = true;
+        opts.emit_line_directives = true;
+        opts.vertex.fixup_clipspace = true;
 
-            spirv_cross::CompilerMSL* msl = (spirv_cross::CompilerMSL*)compiler.get();
-            spirv_cross::CompilerMSL::Options msl_opts = msl->get_msl_options();
-            if (args.platform == PLATFORM_MACOS){
-                msl_opts.platform = spirv_cross::CompilerMSL::Options::macOS;
-            }else if (args.platform == PLATFORM_IOS){
-                msl_opts.platform = spirv_cross::CompilerMSL::Options::iOS;
-            }
-            msl_opts.enable_decoration_binding = true;
-            msl_opts.msl_version = args.version;
+        spirv_cross::CompilerMSL* msl = (spirv_cross::CompilerMSL*)compiler.get();
+        spirv_cross::CompilerMSL::Options msl_opts = msl->get_msl_options();
+        if (args.platform == PLATFORM_MACOS){
+            msl_opts.platform = spirv_cross::CompilerMSL::Options::macOS;
+        }else if (args.platform == PLATFORM_IOS){
+            msl_opts.platform = spirv_cross::CompilerMSL::Options::iOS;
+        }
+        msl_opts.enable_decoration_binding = true;
+        msl_opts.msl_version = args.version;
 
-            msl->set_msl_options(msl_opts);
+        msl->set_msl_options(msl_opts);
 
-        }
+    }
 
-        compiler->set_common_options(opts);
+    compiler->set_common_options(opts);
 
-        // Vertex attribute remap for HLSL
-        if (args.lang == LANG_HLSL) {
-            spirv_cross::CompilerHLSL* hlsl_compiler = (spirv_cross::CompilerHLSL*)compiler.get();
-            for (int i = 0; i < VERTEX_ATTRIB_COUNT; i++) {
-                spirv_cross::HLSLVertexAttributeRemap remap = { (uint32_t)i, k_attrib_names[i] };
-                hlsl_compiler->add_vertex_attribute_remap(remap);
-            }
+    // Vertex attribute remap for HLSL
+    if (args.lang == LANG_HLSL) {
+        spirv_cross::CompilerHLSL* hlsl_compiler = (spirv_cross::CompilerHLSL*)compiler.get();
+        for (int i = 0; i < VERTEX_ATTRIB_COUNT; i++) {
+            spirv_cross::HLSLVertexAttributeRemap remap = { (uint32_t)i, k_attrib_names[i] };
+            hlsl_compiler->add_vertex_attribute_remap(remap);
         }
+    }
 
-        fix_bind_slots(compiler.get(), inputs[i].stage_type, &args.lang);
+    fix_bind_slots(compiler.get(), input.stage_type, &args.lang);
 
-        spirv_cross::ShaderResources res = compiler->get_shader_resources();
-        if (!validate_uniform_blocks_and_separate_image_samplers(compiler.get(), res, inputs[i]))
-            return false;
+    spirv_cross::ShaderResources res = compiler->get_shader_resources();
+    if (!validate_uniform_blocks_and_separate_image_samplers(compiler.get(), res, input))
+        return false;
 
-        // GL/GLES try to flatten UBs if attributes are same type to use only one glUniform4fv call
-        // TODO: Not for Vulkan
-        if (args.lang == LANG_GLSL) {
-            flatten_uniform_blocks(compiler.get());
-            to_combined_image_samplers(compiler.get());
-        }
-        
-        spirvcrossvec[i].source = compiler->compile();
+    // GL/GLES try to flatten UBs if attributes are same type to use only one glUniform4fv call
+    // TODO: Not for Vulkan
+    if (args.lang == LANG_GLSL) {
+        flatten_uniform_blocks(compiler.get());
+        to_combined_image_samplers(compiler.get());
+    }
+    
+    spirvcross.source = compiler->compile();
 
-        if (!parse_reflection(spirvvec[i].bytecode, inputs[i].stage_type, spirvcrossvec[i]))
-            return false;
+    if (!parse_reflection(spirv.bytecode, input.stage_type, spirvcross))
+        return false;
+
+    return true;
+}
+
+static bool compile_stages_to_lang(std::vector<spirvcross_t>& spirvcrossvec, const std::vector<spirv_t>& spirvvec, const std::vector<input_t>& inputs, const std::vector<std::set<std::string>>& macros, const args_t& args){
+    std::vector<std::string> defines;
+    for (const define_t& def : args.defines){
+        defines.push_back(def.def);
     }
 
+    for (size_t i = 0; i < inputs.size(); i++){
+        spirvcrossvec[i].defines = get_used_defines(defines, macros[i]);
+    }
+
+    // Stages are independent until inputs and outputs are matched
+    std::vector<char> results(inputs.size(), 0);
+    if (!run_parallel(results, (int)inputs.size(), [&](size_t i){
+            // SPIRV-Cross reports errors with exceptions, they cannot leave the worker thread
+            try{
+                return compile_stage_to_lang(spirvcrossvec[i], spirvvec[i], inputs[i], args);
+            }catch (const std::exception& e){
+                print_error("SPIRV-Cross error: %s\n", e.what());
+                return false;
+            }
+        }))
+        return false;
+
     if (!validate_inputs_and_outputs(spirvcrossvec, inputs))
         return false;
 
     return true;
+}
+
+bool supershader::compile_to_lang(std::vector<spirvcross_t>& spirvcrossvec, const std::vector<spirv_t>& spirvvec, const std::vector<input_t>& inputs, const args_t& args){
+    std::vector<std::set<std::string>> macros;
+    get_stage_macros(macros, inputs, args);
+
+    return compile_to_lang(spirvcrossvec, spirvvec, inputs, macros, args);
+}
+
+bool supershader::compile_to_lang(std::vector<spirvcross_t>& spirvcrossvec, const std::vector<spirv_t>& spirvvec, const std::vector<input_t>& inputs, const std::vector<std::set<std::string>>& macros, const args_t& args){
+    if (macros.size() != inputs.size()){
+        print_error("Error in pipeline, macros do not match stages\n");
+        return false;
+    }
+
+    // SPIRV-Cross reports errors with exceptions
+    try{
+        return compile_stages_to_lang(spirvcrossvec, spirvvec, inputs, macros, args);
+    }catch (const std::exception& e){
+        print_error("SPIRV-Cross error: %s\n", e.what());
+        return false;
+    }
 }
\ No newline at end of file
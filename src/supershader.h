@@ -8,7 +8,12 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
+#include <set>
+#include <map>
 #include <cstdint>
+#include <functional>
+#include <memory>
 
 namespace supershader{
 
@@ -28,6 +33,8 @@ namespace supershader{
     inline static const int MaxStorageBuffers = 8;
     inline static const int MaxImageSamplers = 16;
 
+    inline static const int MaxVariantDefines = 16;
+
     enum class BindingType {
         UNIFORM_BLOCK,
         IMAGE,
@@ -58,9 +65,54 @@ namespace supershader{
         OUTPUT_BINARY
     };
 
+    enum opt_level_t{
+        OPT_LEVEL_NONE,
+        OPT_LEVEL_DEFAULT,
+        OPT_LEVEL_SIZE,
+        OPT_LEVEL_PERF
+    };
+
+    // SPIR-V optimization of a target, custom passes replace level passes
+    struct pass_recipe_t{
+        opt_level_t level;
+        std::vector<std::string> passes;
+    };
+
+    struct target_t{
+        std::string name;
+        lang_type_t lang;
+        int version;
+        bool es;
+        platform_t platform;
+    };
+
     struct args_t{
         bool isValid;
 
+        std::string program_name;
+        std::string manifest_file;
+        int jobs;
+        bool isolate;
+        int shard;
+        int shard_count;
+        std::string shard_costs;
+        std::string index_file;
+        std::string merge_file;
+        std::vector<std::string> merge_inputs;
+        std::string cache_dir;
+        int64_t cache_max_size;
+        bool cache_stats;
+        std::string depfile;
+        bool skip_up_to_date;
+        std::string scan_deps;
+        std::string scan_dir;
+        bool watch;
+        std::string profile_passes;
+        std::string autotune;
+        int autotune_budget;
+        bool server;
+        std::string server_socket;
+
         bool useBuffers;
         std::unordered_map<std::string, std::string> fileBuffers;
         
@@ -72,15 +124,32 @@ namespace supershader{
         bool es;
         platform_t platform;
 
+        std::vector<target_t> targets;
+
         std::string output_basename;
         std::string output_dir;
         output_type_t output_type;
 
+        std::vector<std::string> include_dirs;
+        // Deprecated, use include_dirs
         std::string include_dir;
         std::vector<define_t> defines;
+        // Specialization constant values baked into SPIR-V, by name or constant_id
+        std::vector<define_t> spec_constants;
+        std::vector<std::string> variants;
+        std::vector<std::vector<std::string>> variant_excludes;
         bool list_includes;
 
+        opt_level_t opt_level;
+        // Set by -O, --disable-optimization or manifest, recipes do not override it
+        bool opt_level_explicit;
+        // Deprecated, use opt_level (false is OPT_LEVEL_NONE)
         bool optimization;
+        std::string pass_recipe;
+        // Recipes by target name, lang ("glsl", "hlsl", "msl") or "default"
+        std::map<std::string, pass_recipe_t> pass_recipes;
+        // Custom passes of current target, from its recipe
+        std::vector<std::string> passes;
     };
 
     enum stage_type_t{
@@ -98,6 +167,15 @@ namespace supershader{
         std::vector<uint32_t> bytecode;
     };
 
+    // Normalized sources of all stages for one lang preamble and files they include
+    struct preprocessed_t{
+        std::vector<std::string> sources;
+        std::set<std::string> included_files;
+    };
+
+    // By lang preamble, preprocessed once for cache keys and compile
+    typedef std::map<std::string, preprocessed_t> preamble_preprocessed_t;
+
     enum vertex_attribs {
         VERTEX_POSITION = 0,
         VERTEX_NORMAL,
@@ -214,6 +292,14 @@ namespace supershader{
         INVALID
     };
 
+    enum class spec_constant_type_t{
+        BOOL,
+        INT,
+        UINT,
+        FLOAT,
+        INVALID
+    };
+
     enum class texture_type_t {
         TEXTURE_2D,
         TEXTURE_CUBE,
@@ -273,6 +359,14 @@ namespace supershader{
         storage_buffer_type_t type = storage_buffer_type_t::INVALID;
     };
 
+    struct s_spec_constant_t {
+        std::string name;
+        uint32_t constant_id;
+        spec_constant_type_t type = spec_constant_type_t::INVALID;
+        // Raw 32 bits of default value, interpreted by type
+        uint32_t default_value = 0;
+    };
+
     struct s_texture_t {
         std::string name;
         uint32_t set;
@@ -297,6 +391,8 @@ namespace supershader{
     struct spirvcross_t{
         stage_type_t stage_type;
         std::string entry_point;
+        // Defines of args referenced by stage or its includes
+        std::vector<std::string> defines;
 
         std::string source;
 
@@ -307,22 +403,291 @@ namespace supershader{
         std::vector<s_texture_t> textures;
         std::vector<s_sampler_t> samplers;
         std::vector<s_texture_sampler_pair_t> texture_sampler_pairs;
+        std::vector<s_spec_constant_t> spec_constants;
+    };
+
+    struct target_result_t{
+        target_t target;
+        std::vector<input_t> inputs;
+        std::vector<spirvcross_t> spirvcrossvec;
+        std::string json;
+        std::vector<char> sbs;
+    };
+
+    struct compile_result_t{
+        bool success = false;
+        std::string diagnostics;
+        std::vector<target_result_t> targets;
+        // Files included by sources, for depfile
+        std::set<std::string> included_files;
     };
 
+    //
+    // Compiler context for library use, results are returned in memory.
+    // Keeps glslang process state alive while it exists and compile()
+    // can be called from many threads at same time.
+    //
+    class Compiler{
+    public:
+        Compiler();
+        ~Compiler();
+
+        Compiler(const Compiler&) = delete;
+        Compiler& operator=(const Compiler&) = delete;
+
+        compile_result_t compile(const args_t& request);
+
+        // Optional file output, same files of command line tool
+        bool write(const compile_result_t& result, const args_t& request);
+    };
+
+
+    void print_error(const char* format, ...);
+
+    void print_info(const char* format, ...);
+
+    // While set, messages of current thread are appended to capture instead of printed
+    void set_output_capture(std::string* capture);
+
+    std::string* get_output_capture();
 
     args_t initialize_args();
 
     args_t parse_args(int argc, const char **argv);
 
+    // Args with deprecated fields moved to their replacements, a copy in storage only when they are set
+    const args_t& resolve_deprecated_args(args_t& storage, const args_t& args);
+
+    bool load_manifest(std::vector<args_t>& programs, const args_t& args);
+
+    bool load_request(args_t& request, const std::string& request_json, const args_t& args);
+
+    std::vector<target_t> get_targets(const args_t& args);
+
+    void apply_target(args_t& args, const target_t& target);
+
+    bool needs_conservative_passes(const target_t& target);
+
+    // Sets optimization of target from pass recipes
+    void apply_pass_recipe(args_t& args, const target_t& target);
+
+    bool load_pass_recipes(std::map<std::string, pass_recipe_t>& recipes, const std::string& path);
+
+    std::string get_optimization_key(const args_t& args);
+
+    struct spirv_stats_t{
+        uint64_t words = 0;
+        uint64_t instructions = 0;
+        uint64_t functions = 0;
+    };
+
+    struct pass_profile_t{
+        std::string name;
+        double time_ms = 0;
+        spirv_stats_t before;
+        spirv_stats_t after;
+    };
+
+    struct stage_profile_t{
+        std::string program;
+        std::string file;
+        stage_type_t stage_type;
+        std::string optimization;
+        std::vector<std::string> defines;
+        std::vector<pass_profile_t> passes;
+    };
+
+    spirv_stats_t get_spirv_stats(const std::vector<uint32_t>& spirv);
+
+    // Profiles of all compiles of this process, written at end
+    void add_stage_profile(const stage_profile_t& profile);
+
+    bool write_pass_profile(const args_t& args);
+
+    std::vector<args_t> get_target_args(const args_t& args);
+
+    std::string get_lang_preamble(const args_t& args);
+
+    bool compile_program(const args_t& args);
+
+    bool compile_program_results(std::vector<target_result_t>& results, std::set<std::string>& included_files, const args_t& args);
+
+    bool write_program_results(const std::vector<target_result_t>& results, const std::set<std::string>& included_files, const args_t& args);
+
+    std::vector<std::string> get_output_files(const args_t& args);
+
+    bool compile_variants(std::set<std::string>& included_files, const args_t& args);
+
+    bool get_dependencies(std::set<std::string>& files, const args_t& args);
+
+    // Does nothing if args has no depfile, included files are the ones opened by compile
+    bool write_depfile(const args_t& args, const std::set<std::string>& included_files);
+
+    bool is_up_to_date(const args_t& args);
+
+    bool scan_dependencies(const std::vector<args_t>& programs, const args_t& args);
+
+    // Writes pass recipe with best passes of each target for programs (or --scan-dir) as corpus
+    bool autotune_passes(const std::vector<args_t>& programs, const args_t& args);
+
+    // Compiles all programs, then again the ones affected by each change, until it fails
+    bool watch_programs(const std::vector<args_t>& programs, const args_t& args);
+
+    // Macros are of get_stage_macros, scanned once by program
+    std::string get_program_cache_key(preamble_preprocessed_t& preprocessed, const std::vector<input_t>& inputs, const std::vector<std::set<std::string>>& macros, const args_t& args);
+
+    bool load_cached_program(std::vector<target_result_t>& results, const std::string& key, const std::vector<input_t>& inputs, const args_t& args);
+
+    bool store_cached_program(const std::vector<target_result_t>& results, const std::string& key, const args_t& args);
+
+    struct cache_stats_t{
+        uint64_t program_hits = 0;
+        uint64_t program_misses = 0;
+        uint64_t stage_hits = 0;
+        uint64_t stage_misses = 0;
+        uint64_t evictions = 0;
+    };
+
+    // Counters of this process
+    cache_stats_t get_cache_stats();
+
+    void add_cache_stats(const cache_stats_t& stats);
+
+    void print_cache_stats(const args_t& args);
+
+    std::string get_spirv_cache_key(const std::vector<input_t>& inputs, const std::vector<std::string>& normalized, const args_t& args);
+
+    // SPIR-V of all stages, a hit needs every stage
+    bool load_cached_spirv(std::vector<spirv_t>& spirvvec, const std::string& key, const args_t& args);
+
+    bool store_cached_spirv(const std::vector<spirv_t>& spirvvec, const std::string& key, const args_t& args);
+
+    struct sha256_t{
+        uint32_t state[8];
+        uint64_t length;
+        unsigned char buffer[64];
+        size_t buffer_size;
+    };
+
+    void sha256_init(sha256_t& ctx);
+
+    void sha256_update(sha256_t& ctx, const void* data, size_t size);
+
+    void sha256_update(sha256_t& ctx, const std::string& str);
+
+    std::string sha256_final(sha256_t& ctx);
+
+    std::string sha256(const std::string& data);
+
+    bool run_parallel(std::vector<char>& results, int jobs, const std::function<bool(size_t)>& task);
+
+    // How often a waiting worker checks for a token and if there is still work to do
+    inline static const int JobserverPollMs = 50;
+
+    bool jobserver_enabled();
+
+    bool jobserver_try_acquire(char& token);
+
+    // Blocks for a make jobserver token while needed() is true
+    bool jobserver_acquire(char& token, const std::function<bool()>& needed);
+
+    void jobserver_release(char token);
+
+    bool compile_batch(const std::vector<args_t>& programs, const args_t& args);
+
+    bool select_shard(std::vector<args_t>& programs, const args_t& args);
+
+    bool write_batch_index(const std::vector<args_t>& programs, const std::vector<char>& results, const std::vector<double>& times, const args_t& args);
+
+    bool merge_batch_indices(const args_t& args);
+
+    bool run_server(const args_t& args);
+
+    void initialize_process();
+
+    void finalize_process();
+
+    // Keeps glslang process state alive while in scope
+    struct process_reference_t{
+        process_reference_t(){ initialize_process(); }
+        ~process_reference_t(){ finalize_process(); }
+    };
+
+    // Read-only file content, large files are mapped
+    struct file_content_t{
+        const char* data = "";
+        size_t size = 0;
+        void* mapping = nullptr;
+        std::string buffer;
+
+        file_content_t() = default;
+        file_content_t(const file_content_t&) = delete;
+        file_content_t& operator=(const file_content_t&) = delete;
+        ~file_content_t();
+    };
+
+    // Shared by all threads and bounded, content is read again when mtime or size changes
+    std::shared_ptr<const file_content_t> get_cached_file(const std::string& path);
+
+    int get_process_id();
+
+    // Replaces file atomically
+    bool write_output_file(const std::string& path, const std::string& content);
+
+    // Include lookups of one compile, over a directory index shared by all threads
+    struct include_resolver_t{
+        std::vector<std::string> directories;
+        std::unordered_map<std::string, std::string> resolved;
+        std::unordered_set<std::string> validated;
+    };
+
+    // Searches directory of stage file, then include directories
+    bool resolve_include(std::string& path, include_resolver_t& resolver, const std::string& stage_directory, const std::string& name);
+
     bool load_input(std::vector<input_t>& inputs, const args_t& args);
 
+    bool preprocess_normalized(std::vector<std::string>& sources, std::set<std::string>& included_files, const std::vector<input_t>& inputs, const args_t& args);
+
+    // Macros tested or expanded anywhere in each stage and its includes, inactive branches too
+    void get_stage_macros(std::vector<std::set<std::string>>& macros, const std::vector<input_t>& inputs, const args_t& args);
+
+    // Files of every #include in all branches, found without preprocessing
+    void get_all_includes(std::set<std::string>& included_files, std::set<std::string>& missing_files, const std::vector<input_t>& inputs, const args_t& args);
+
+    std::vector<std::string> get_used_defines(const std::vector<std::string>& defines, const std::set<std::string>& macros);
+
     bool compile_to_spirv(std::vector<spirv_t>& spirvvec, const std::vector<input_t>& inputs, const args_t& args);
 
+    // Sources already preprocessed for this preamble are used for stage cache keys
+    bool compile_to_spirv(std::vector<spirv_t>& spirvvec, std::set<std::string>& included_files, const std::vector<input_t>& inputs, const args_t& args, const preprocessed_t* preprocessed = nullptr);
+
+    // Replaces specialization constants of args by constants with their values
+    bool specialize_spirv(spirv_t& spirv, std::vector<char>& matched, const args_t& args);
+
+    // Optimizes SPIR-V compiled with -O0, by level or passes of args
+    bool optimize_spirv(spirv_t& spirv, const args_t& args);
+
+    // spirv-opt flags of all passes run by level or passes of args
+    bool get_optimization_passes(std::vector<std::string>& passes, const args_t& args);
+
     bool compile_to_lang(std::vector<spirvcross_t>& spirvcrossvec, const std::vector<spirv_t>& spirvvec, const std::vector<input_t>& inputs, const args_t& args);
 
+    // Macros of stages from get_stage_macros, all targets of a program share them
+    bool compile_to_lang(std::vector<spirvcross_t>& spirvcrossvec, const std::vector<spirv_t>& spirvvec, const std::vector<input_t>& inputs, const std::vector<std::set<std::string>>& macros, const args_t& args);
+
     bool generate_json(const std::vector<spirvcross_t>& spirvcrossvec, const std::vector<input_t>& inputs, const args_t& args);
 
+    bool generate_json_buffer(std::string& buffer, const std::vector<spirvcross_t>& spirvcrossvec, const std::vector<input_t>& inputs, const args_t& args);
+
+    std::string get_json_file(const args_t& args);
+
+    bool parse_json_buffer(std::vector<spirvcross_t>& spirvcrossvec, std::vector<input_t>& inputs, const std::string& buffer);
+
     bool generate_sbs(const std::vector<spirvcross_t>& spirvcrossvec, const std::vector<input_t>& inputs, const args_t& args);
+
+    std::string get_sbs_file(const args_t& args);
+
+    bool generate_sbs_buffer(std::vector<char>& buffer, const std::vector<spirvcross_t>& spirvcrossvec, const std::vector<input_t>& inputs, const args_t& args);
 }
 
 #endif //supershader_h
\ No newline at end of file
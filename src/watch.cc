@@ -0,0 +1,248 @@
+//
+// (c) 2024 Eduardo Doria.
+//
+
+#include "supershader.h"
+
+#include <map>
+#include <filesystem>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+using namespace supershader;
+
+#ifdef __linux__
+
+// Changes that come together (editor saves, header and shader) are compiled once
+static const int WatchSettleMs = 100;
+
+struct watch_state_t{
+    int fd = -1;
+    std::map<std::string, int> watches;
+    std::map<int, std::string> watch_dirs;
+    // Reverse dependency graph: file to programs that include it
+    std::map<std::string, std::set<size_t>> dependents;
+    std::vector<std::set<std::string>> program_files;
+    // Directories searched by programs with missing includes
+    std::vector<std::set<std::string>> missing_dirs;
+    std::string manifest;
+    bool manifest_changed = false;
+};
+
+static std::string normalize_path(const std::string& path){
+    std::error_code ec;
+    std::string normalized = std::filesystem::weakly_canonical(path, ec).string();
+    return ec ? path : normalized;
+}
+
+static std::string get_parent_directory(const std::string& path){
+    return std::filesystem::path(path).parent_path().string();
+}
+
+// Directories are watched, editors often replace files instead of writing them
+static void add_watch(watch_state_t& state, const std::string& directory){
+    if (directory.empty() || state.watches.find(directory) != state.watches.end())
+        return;
+
+    int wd = inotify_add_watch(state.fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE);
+    if (wd < 0){
+        print_error("Unable to watch %s: %s\n", directory.c_str(), strerror(errno));
+        return;
+    }
+
+    state.watches[directory] = wd;
+    state.watch_dirs[wd] = directory;
+}
+
+static void update_dependencies(watch_state_t& state, size_t p, const args_t& program){
+    std::set<std::string> files;
+    std::set<std::string> missing;
+
+    // Program with errors is still watched, so it is compiled again when fixed
+    if (!get_dependencies(files, program)){
+        files.clear();
+
+        std::vector<input_t> inputs;
+        if (!program.vert_file.empty())
+            files.insert(program.vert_file);
+        if (!program.frag_file.empty())
+            files.insert(program.frag_file);
+        if (load_input(inputs, program))
+            get_all_includes(files, missing, inputs, program);
+    }
+
+    for (const std::string& file : state.program_files[p]){
+        state.dependents[file].erase(p);
+    }
+
+    std::set<std::string> normalized;
+    for (const std::string& file : files){
+        std::string path = normalize_path(file);
+        normalized.insert(path);
+        state.dependents[path].insert(p);
+        add_watch(state, get_parent_directory(path));
+    }
+    state.program_files[p] = normalized;
+
+    state.missing_dirs[p].clear();
+    if (!missing.empty()){
+        for (const std::string& file : {program.vert_file, program.frag_file}){
+            if (!file.empty())
+                state.missing_dirs[p].insert(get_parent_directory(normalize_path(file)));
+        }
+        for (const std::string& dir : program.include_dirs){
+            state.missing_dirs[p].insert(normalize_path(dir));
+        }
+        for (const std::string& dir : state.missing_dirs[p]){
+            add_watch(state, dir);
+        }
+    }
+}
+
+// Waits for changes and returns programs affected by them
+static bool wait_changes(watch_state_t& state, std::set<size_t>& affected){
+    alignas(inotify_event) char buffer[4096];
+    int timeout = -1;
+
+    while (true){
+        pollfd pfd = {state.fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, timeout);
+        if (ready < 0){
+            if (errno == EINTR)
+                continue;
+            print_error("Watch failed: %s\n", strerror(errno));
+            return false;
+        }
+        if (ready == 0){
+            if (!affected.empty() || state.manifest_changed)
+                return true;
+            timeout = -1;
+            continue;
+        }
+
+        ssize_t n = read(state.fd, buffer, sizeof(buffer));
+        if (n < 0){
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            print_error("Watch failed: %s\n", strerror(errno));
+            return false;
+        }
+
+        for (char* ptr = buffer; ptr < buffer + n; ptr += sizeof(inotify_event) + ((inotify_event*)ptr)->len){
+            const inotify_event* event = (const inotify_event*)ptr;
+            auto dir = state.watch_dirs.find(event->wd);
+            if (dir == state.watch_dirs.end() || event->len == 0)
+                continue;
+
+            std::string path = dir->second + "/" + event->name;
+            if (path == state.manifest)
+                state.manifest_changed = true;
+
+            auto it = state.dependents.find(path);
+            if (it != state.dependents.end())
+                affected.insert(it->second.begin(), it->second.end());
+
+            for (size_t p = 0; p < state.missing_dirs.size(); p++){
+                if (state.missing_dirs[p].count(dir->second))
+                    affected.insert(p);
+            }
+        }
+
+        // Keeps reading until files stop changing
+        timeout = WatchSettleMs;
+    }
+}
+
+static void watch_all(watch_state_t& state, const std::vector<args_t>& programs){
+    state.dependents.clear();
+    state.program_files.assign(programs.size(), std::set<std::string>());
+    state.missing_dirs.assign(programs.size(), std::set<std::string>());
+    for (size_t p = 0; p < programs.size(); p++){
+        update_dependencies(state, p, programs[p]);
+    }
+
+    fprintf(stdout, "Watching %i files of %i programs\n", (int)state.dependents.size(), (int)programs.size());
+    fflush(stdout);
+}
+
+bool supershader::watch_programs(const std::vector<args_t>& programs, const args_t& args){
+    process_reference_t process;
+
+    std::vector<args_t> watched = programs;
+    compile_batch(watched, args);
+
+    watch_state_t state;
+    state.fd = inotify_init1(IN_CLOEXEC);
+    if (state.fd < 0){
+        print_error("Unable to start watch: %s\n", strerror(errno));
+        return false;
+    }
+
+    if (!args.manifest_file.empty()){
+        state.manifest = normalize_path(args.manifest_file);
+        add_watch(state, get_parent_directory(state.manifest));
+    }
+
+    watch_all(state, watched);
+
+    std::set<size_t> affected;
+    while (wait_changes(state, affected)){
+        // Programs may have changed, all are compiled again
+        if (state.manifest_changed){
+            state.manifest_changed = false;
+            affected.clear();
+
+            std::vector<args_t> reloaded;
+            if (!load_manifest(reloaded, args)){
+                print_error("Manifest not reloaded, keeping previous programs\n");
+                continue;
+            }
+            watched = reloaded;
+            compile_batch(watched, args);
+            watch_all(state, watched);
+            continue;
+        }
+
+        std::vector<size_t> changed(affected.begin(), affected.end());
+        affected.clear();
+
+        // Pass recipe is a dependency too, it is read again
+        for (size_t p : changed){
+            args_t& program = watched[p];
+            if (!program.pass_recipe.empty())
+                load_pass_recipes(program.pass_recipes, program.pass_recipe);
+        }
+
+        // Programs of one change are independent
+        std::vector<char> results(changed.size(), 0);
+        run_parallel(results, args.jobs, [&](size_t i){
+            return compile_program(watched[changed[i]]);
+        });
+
+        for (size_t i = 0; i < changed.size(); i++){
+            const args_t& program = watched[changed[i]];
+            update_dependencies(state, changed[i], program);
+            fprintf(stdout, "  %s: %s\n", (program.program_name.empty() ? program.output_basename : program.program_name).c_str(), results[i] ? "success" : "failed");
+        }
+        fflush(stdout);
+    }
+
+    close(state.fd);
+
+    return false;
+}
+
+#else
+
+bool supershader::watch_programs(const std::vector<args_t>& programs, const args_t& args){
+    print_error("Watch mode needs inotify, it is only supported on Linux\n");
+    return false;
+}
+
+#endif
@@ -0,0 +1,165 @@
+//
+// (c) 2024 Eduardo Doria.
+//
+// Compiles programs from many threads while glslang process state and
+// SPIR-V generation pools are created and freed, results must match
+// single thread ones. Run it built with -fsanitize=thread to find races.
+//
+
+#include "supershader.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <atomic>
+
+using namespace supershader;
+
+static const char* CommonSource = R"(
+vec4 transform(mat4 m, vec3 p){
+    return m * vec4(p, 1.0);
+}
+)";
+
+static const char* VertSource = R"(
+#version 450
+#include "common.glsl"
+layout(location = 0) in vec3 a_position;
+layout(location = 1) in vec2 a_texcoord;
+layout(location = 0) out vec2 v_texcoord;
+layout(set = 0, binding = 0) uniform u_vs_params{
+    mat4 mvp;
+} vs;
+void main(){
+    v_texcoord = a_texcoord;
+    gl_Position = transform(vs.mvp, a_position);
+}
+)";
+
+static const char* FragSource = R"(
+#version 450
+layout(location = 0) in vec2 v_texcoord;
+layout(location = 0) out vec4 color;
+#ifdef HAS_TEXTURE
+layout(set = 0, binding = 1) uniform texture2D u_texture;
+layout(set = 0, binding = 3) uniform sampler u_sampler;
+#endif
+layout(set = 0, binding = 2) uniform u_fs_params{
+    vec4 tint;
+} fs;
+void main(){
+#ifdef HAS_TEXTURE
+    color = texture(sampler2D(u_texture, u_sampler), v_texcoord) * fs.tint;
+#else
+    color = vec4(v_texcoord, 0.0, 1.0) * fs.tint;
+#endif
+}
+)";
+
+static const int ProgramCount = 6;
+
+static args_t get_program_args(int p){
+    static const lang_type_t langs[3] = {LANG_GLSL, LANG_HLSL, LANG_MSL};
+    static const int versions[3] = {330, 50, 20100};
+
+    args_t args = initialize_args();
+    args.useBuffers = true;
+    args.fileBuffers["stress.vert"] = VertSource;
+    args.fileBuffers["stress.frag"] = FragSource;
+    args.fileBuffers["common.glsl"] = CommonSource;
+    args.vert_file = "stress.vert";
+    args.frag_file = "stress.frag";
+    args.output_basename = "stress";
+    args.lang = langs[p % 3];
+    args.version = versions[p % 3];
+    args.platform = PLATFORM_MACOS;
+    if (p >= 3)
+        args.defines.push_back({"HAS_TEXTURE", ""});
+
+    return args;
+}
+
+int main(int argc, char** argv){
+    int threads = (argc > 1) ? atoi(argv[1]) : (int)std::thread::hardware_concurrency();
+    int iterations = (argc > 2) ? atoi(argv[2]) : 20;
+    if (threads < 4)
+        threads = 4;
+
+    std::vector<std::string> reference(ProgramCount);
+    {
+        Compiler compiler;
+        for (int p = 0; p < ProgramCount; p++){
+            compile_result_t result = compiler.compile(get_program_args(p));
+            if (!result.success){
+                fprintf(stderr, "Program %i failed:\n%s", p, result.diagnostics.c_str());
+                return 1;
+            }
+            reference[p] = result.targets[0].json;
+        }
+    }
+
+    std::atomic<int> failed(0);
+    std::atomic<bool> running(true);
+
+    auto check = [&](bool success, const std::vector<target_result_t>& targets, int p){
+        if (!success || targets.size() != 1 || targets[0].json != reference[p])
+            failed++;
+    };
+
+    // Process state goes to zero references and back while other threads compile
+    auto process_worker = [&](){
+        while (running){
+            initialize_process();
+            finalize_process();
+        }
+    };
+
+    // Compiler API, a Compiler keeps process state alive
+    {
+        Compiler compiler;
+        std::thread process_thread(process_worker);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++){
+            workers.emplace_back([&, t](){
+                for (int i = 0; i < iterations; i++){
+                    int p = (t + i) % ProgramCount;
+                    compile_result_t result = compiler.compile(get_program_args(p));
+                    check(result.success, result.targets, p);
+                }
+            });
+        }
+        for (std::thread& worker : workers){
+            worker.join();
+        }
+        running = false;
+        process_thread.join();
+    }
+
+    // Pipeline without a Compiler, process state and pools are freed between compiles
+    running = true;
+    {
+        std::thread process_thread(process_worker);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++){
+            workers.emplace_back([&, t](){
+                for (int i = 0; i < iterations; i++){
+                    int p = (t + i) % ProgramCount;
+                    std::vector<target_result_t> targets;
+                    std::set<std::string> included_files;
+                    bool success = compile_program_results(targets, included_files, get_program_args(p));
+                    check(success, targets, p);
+                }
+            });
+        }
+        for (std::thread& worker : workers){
+            worker.join();
+        }
+        running = false;
+        process_thread.join();
+    }
+
+    int total = threads * iterations * 2;
+    printf("%i compiles from %i threads, %i failed\n", total, threads, failed.load());
+
+    return failed == 0 ? 0 : 1;
+}